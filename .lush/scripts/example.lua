@@ -40,11 +40,99 @@ if lush.exec('echo "hello world"\n') then
 	print("echo worked properly")
 end
 
+-- commands run by a script are not added to history unless asked for
+-- either per call with an options table or for the rest of the script with recordHistory
+lush.exec('echo "this one is kept in history"', { history = true })
+lush.recordHistory(true)
+lush.exec('echo "so is this one"')
+lush.recordHistory(false)
+
+-- compile parses a command once and returns a handle that can be run many times
+-- environment variables in it are still looked up on every run
+local greet = lush.compile('echo "compiled command" $USER')
+for _ = 1, 3 do
+	greet:run()
+end
+
+-- capture runs a command and returns its stdout, stderr and exit code
+local out, err, code = lush.capture('ls "/nonexistent-example-dir"')
+print("ls exited with " .. code .. " and wrote " .. #out .. " bytes to stdout")
+print("stderr: " .. err)
+
+-- lines iterates over the output of a command as it is produced
+-- only the current line is held in memory so it works on huge outputs
+for line in lush.lines('cat "' .. lush.getenv("HOME") .. '/.lush/scripts/example.lua" | grep "lush.lines"') do
+	print("found: " .. line)
+end
+
+-- parallel runs a list of commands at the same time, at most jobs of them at once
+-- each result holds the exit status and wall time in seconds of its command
+-- with capture = true the results also hold stdout and stderr
+local results = lush.parallel({ "sleep 1", "sleep 1", 'echo "in parallel"' }, { jobs = 3, capture = true })
+for i, result in ipairs(results) do
+	print(i .. ": status " .. result.status .. " in " .. string.format("%.2f", result.time) .. "s")
+end
+print(results[3].stdout)
+
+-- spawn starts a command without waiting for it and returns a handle
+-- with capture = true the handle can read its stdout in chunks, nil means EOF
+-- inside of lush.async wait and read only suspend the calling coroutine
+-- so many commands can run and be read at the same time
+for i = 1, 3 do
+	lush.async(function()
+		local h = lush.spawn('sh -c "sleep ' .. i .. '; echo task ' .. i .. '"', { capture = true })
+		local out = h:read() or "nothing\n"
+		print("read: " .. out .. "exit: " .. h:wait())
+	end)
+end
+-- run waits for all async tasks, scripts also do this when they end
+lush.run()
+-- outside of a task wait blocks while still letting tasks make progress
+local h = lush.spawn("sleep 1")
+h:kill()
+print(h:wait())
+
+-- filter registers a Lua function as a pipeline stage named lua:name
+-- it runs in a fork of the shell and is called with each line of input
+-- plus any args given to the stage, the returned string is written out
+-- and returning nil drops the line, global functions work the same way
+lush.filter("upper", function(line)
+	return line:upper()
+end)
+lush.filter("match", function(line, pattern)
+	if line:find(pattern) then
+		return line
+	end
+end)
+lush.exec("ls -a | lua:match lua | lua:upper")
+
+-- builtin adds a command that runs in the shell itself without forking
+-- it gets the args of the command line, an integer return is the exit status
+-- and false counts as a failure, passing nil instead of a function removes it
+lush.builtin("greet", function(name)
+	print("hello " .. (name or "world"))
+	return 0
+end)
+lush.exec("greet moon")
+
 -- debug mode can be used to log execution of commands
 lush.debug(true) -- enters debug
 lush.exec('echo "echo in debug mode"')
 lush.debug(false) -- exits debug
 
+-- tracing records how long parsing, spawning, waiting and Lua take, the
+-- timeline can be opened in chrome://tracing or ui.perfetto.dev, setting
+-- LUSH_TRACE to a file name traces a whole session and writes it on exit
+lush.trace(true)
+lush.exec("ls -a | wc -l")
+lush.trace(false)
+lush.traceExport("/tmp/lush-trace.json")
+
+-- stats returns counters kept since the shell started, such as commands
+-- run, forks and child wall time, the stats builtin prints the same values
+local stats = lush.stats()
+print("forks: " .. stats.forks .. ", p99 child time: " .. stats.child_time_p99 .. "s")
+
 -- getcwd returns the current working directory
 local cwd = lush.getcwd()
 print(cwd)
@@ -55,6 +143,12 @@ lush.cd("~/.lush/scripts")
 lush.exec('cat "example.lua" | grep "hello" | sort | uniq')
 lush.cd(cwd)
 
+-- every stage of a pipeline runs at the same time
+-- pipestatus returns the exit code of each stage of the last pipeline
+lush.exec('echo "stage one" | grep "missing"')
+local statuses = lush.pipestatus()
+print("echo exited with " .. statuses[1] .. ", grep exited with " .. statuses[2])
+
 -- exists allows you to check if a file or directory exists
 if lush.exists("~/.lush/scripts/example.lua") then
 	print("example.lua exists")
@@ -69,6 +163,12 @@ if not lush.isDirectory("~/.lush/scripts/example.lua") then
 	print("example.lua is not a directory")
 end
 
+-- glob returns a sorted table of the paths matching a pattern, ** matches
+-- any number of directories and commands expand unquoted patterns the same way
+for _, path in ipairs(lush.glob(".lush/**/*.lua")) do
+	print("found script " .. path)
+end
+
 -- you can also check if a file is readable/writeable
 if lush.isReadable("~/.lush/scripts/example.lua") then
 	print("example.lua is readable")
@@ -77,14 +177,43 @@ if lush.isWriteable("~/.lush/scripts/example.lua") then
 	print("example.lua is writeable")
 end
 
+-- stat returns every attribute of a path from a single syscall, or nil and
+-- an error message, pass false as the second argument to not follow links
+local info = lush.stat("~/.lush/scripts/example.lua")
+if info then
+	print("example.lua is a " .. info.type .. " of " .. info.size .. " bytes")
+	print(string.format("mode %o, modified at %.0f", info.mode, info.mtime))
+end
+
+-- readdir lists a directory without spawning ls, each entry has a name and type
+for _, entry in ipairs(lush.readdir("~/.lush/scripts")) do
+	print(entry.name .. " is a " .. entry.type)
+end
+
+-- statAll checks many paths in one call, paths that do not exist give false
+local paths = { "~/.lush/scripts", "~/.lush/missing" }
+for i, result in ipairs(lush.statAll(paths)) do
+	print(paths[i] .. (result and (" is a " .. result.type) or " does not exist"))
+end
+
 -- you can fetch the most recently executed command in history
 print("Most recent history: " .. lush.lastHistory())
 
 -- you can also fetch history at a certain index in the past (1 being most recent)
 print("Most recent history indexed: " .. lush.getHistory(1))
 
--- you can set environment variables using putenv
+-- you can set environment variables using putenv, they are exported to commands
+-- and can be used as $EXAMPLE or ${EXAMPLE} anywhere in a command
 lush.putenv("EXAMPLE=Lunar Shell Example")
+lush.exec("echo ${EXAMPLE}!")
 
--- you can get an environment variable using getenv
+-- $(...) in a command is replaced by the output of the command inside it,
+-- several of them in one line run at the same time
+lush.exec("echo running in $(pwd) as $(whoami)")
+
+-- you can get an environment variable using getenv, shell variables set with
+-- NAME=value at the prompt are found too
 print("Value of EXAMPLE: " .. lush.getenv("EXAMPLE"))
+
+-- putenv with only a name removes the variable again
+lush.putenv("EXAMPLE")
@@ -0,0 +1,416 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+// micro benchmarks for the hot paths of the shell, run every case or the
+// ones named on the command line, results are printed as one JSON object
+// per line so they can be compared across releases
+
+#define _GNU_SOURCE
+#include "arena.h"
+#include "history.h"
+#include "lua_api.h"
+#include "lush.h"
+#include "spawn_helper.h"
+#include <fcntl.h>
+#include <lauxlib.h>
+#include <lua.h>
+#include <lualib.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// every timed loop runs at least this long so the clock is not the limit
+#define MIN_BENCH_NS 500000000ULL
+#define MAX_CORPUS_LINES 4096
+#define PIPELINE_BYTES (256 * 1024 * 1024)
+#define STARTUP_RUNS 20
+#define HELPER_RUNS 500
+
+extern char **environ;
+
+typedef struct {
+	const char *name;
+	void (*run)();
+} bench_case_t;
+
+// -- helpers --
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void report(const char *bench, const char *metric, double value,
+				   const char *unit) {
+	printf("{\"bench\":\"%s\",\"metric\":\"%s\",\"value\":%.3f,"
+		   "\"unit\":\"%s\"}\n",
+		   bench, metric, value, unit);
+	fflush(stdout);
+}
+
+static char *corpus[MAX_CORPUS_LINES];
+static int corpus_len = 0;
+
+static void load_corpus() {
+	if (corpus_len > 0)
+		return;
+	const char *path = getenv("LUSH_BENCH_CORPUS");
+	if (path == NULL)
+		path = "bench/corpus.txt";
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) {
+		perror(path);
+		exit(1);
+	}
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	while (corpus_len < MAX_CORPUS_LINES &&
+		   (len = getline(&line, &cap, fp)) != -1) {
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (len > 0)
+			corpus[corpus_len++] = strdup(line);
+	}
+	free(line);
+	fclose(fp);
+	// every benchmark indexes the corpus modulo its length
+	if (corpus_len == 0) {
+		fprintf(stderr, "lush-bench: %s: no commands in corpus\n", path);
+		exit(1);
+	}
+}
+
+static int run_quiet(char ***args, lush_redirect_t **redirects, int count) {
+	// stdout of the benchmarked commands would mix with the results
+	fflush(stdout);
+	int saved = dup(STDOUT_FILENO);
+	int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	dup2(null_fd, STDOUT_FILENO);
+	close(null_fd);
+	int rc = lush_execute_pipeline(args, redirects, count, false);
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+	return rc;
+}
+
+// -- parsing --
+
+static void bench_parse() {
+	load_corpus();
+	lush_arena_t arena;
+	lush_arena_init(&arena);
+
+	uint64_t lines = 0;
+	uint64_t bytes = 0;
+	uint64_t start = now_ns();
+	uint64_t elapsed;
+	do {
+		for (int i = 0; i < corpus_len; i++) {
+			char *line = lush_arena_strdup(&arena, corpus[i]);
+			bytes += strlen(line);
+			lush_split_background(line);
+			char **commands = lush_split_pipes(&arena, line);
+			lush_redirect_t **redirects;
+			int status = 0;
+			lush_split_args(&arena, commands, &redirects, &status);
+			lush_arena_reset(&arena);
+		}
+		lines += corpus_len;
+		elapsed = now_ns() - start;
+	} while (elapsed < MIN_BENCH_NS);
+
+	lush_arena_free(&arena);
+	report("parse", "ns_per_line", (double)elapsed / lines, "ns");
+	report("parse", "throughput", bytes / (elapsed / 1e9) / 1e6, "MB/s");
+}
+
+// -- history --
+
+static void run_history(const char *bench, int size) {
+	// the ring size is fixed on first use, so every size gets a fresh
+	// process, lush_history_init is never called so ~/.lush is not touched
+	char size_env[16];
+	snprintf(size_env, sizeof(size_env), "%d", size);
+	setenv("HISTSIZE", size_env, 1);
+
+	char line[512];
+	uint64_t start = now_ns();
+	for (int i = 0; i < size; i++) {
+		snprintf(line, sizeof(line), "%s %d", corpus[i % corpus_len], i);
+		lush_push_history(line);
+	}
+	report(bench, "fill_ns_per_push", (double)(now_ns() - start) / size,
+		   "ns");
+
+	// the ring is full now so every push also evicts the oldest entry
+	int pushes = 100000;
+	start = now_ns();
+	for (int i = 0; i < pushes; i++) {
+		snprintf(line, sizeof(line), "%s %d", corpus[i % corpus_len],
+				 size + i);
+		lush_push_history(line);
+	}
+	report(bench, "push_ns", (double)(now_ns() - start) / pushes, "ns");
+
+	int lookups = 1000000;
+	start = now_ns();
+	for (int i = 0; i < lookups; i++)
+		lush_get_past_command((i * 7919L) % size);
+	report(bench, "get_ns", (double)(now_ns() - start) / lookups, "ns");
+
+	// a full Ctrl-R walk over every match of a common substring
+	int searches = 0;
+	start = now_ns();
+	uint64_t elapsed;
+	do {
+		int pos = lush_history_search("git commit", 0, false, true);
+		while (pos != -1)
+			pos = lush_history_search("git commit", pos + 1, false, true);
+		searches++;
+		elapsed = now_ns() - start;
+	} while (elapsed < MIN_BENCH_NS / 5);
+	report(bench, "search_all_us", elapsed / 1e3 / searches, "us");
+}
+
+static void bench_history_at(const char *bench, int size) {
+	load_corpus();
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0) {
+		run_history(bench, size);
+		fflush(stdout);
+		_exit(0);
+	}
+	if (pid == -1) {
+		perror("fork");
+		exit(1);
+	}
+	int status;
+	if (waitpid(pid, &status, 0) == -1) {
+		perror("waitpid");
+		exit(1);
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		if (WIFSIGNALED(status))
+			fprintf(stderr, "lush-bench: %s: killed by signal %d\n", bench,
+					WTERMSIG(status));
+		else
+			fprintf(stderr, "lush-bench: %s: exited with status %d\n", bench,
+					WEXITSTATUS(status));
+		exit(1);
+	}
+}
+
+static void bench_history_512() { bench_history_at("history_512", 512); }
+static void bench_history_10k() { bench_history_at("history_10k", 10000); }
+static void bench_history_100k() { bench_history_at("history_100k", 100000); }
+
+// -- spawning --
+
+static void bench_exec() {
+	lua_State *L = luaL_newstate();
+	luaL_openlibs(L);
+	lua_register_api(L);
+
+	// one warm up call so the PATH lookup is cached like in a session
+	const char *script = "local n = ...\n"
+						 "for i = 1, n do lush.exec('true') end\n";
+	int runs = 200;
+	for (int round = 0; round < 2; round++) {
+		int count = round == 0 ? 1 : runs;
+		if (luaL_loadstring(L, script) != LUA_OK) {
+			fprintf(stderr, "%s\n", lua_tostring(L, -1));
+			break;
+		}
+		lua_pushinteger(L, count);
+		uint64_t start = now_ns();
+		if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+			fprintf(stderr, "%s\n", lua_tostring(L, -1));
+			break;
+		}
+		if (round == 1)
+			report("exec", "round_trip_us",
+				   (now_ns() - start) / 1e3 / count, "us");
+	}
+	lua_close(L);
+}
+
+static void bench_pipeline() {
+	// bytes flow through two copies so the pipes dominate, not the source
+	char line[128];
+	snprintf(line, sizeof(line), "head -c %d /dev/zero | cat | cat",
+			 PIPELINE_BYTES);
+	lush_arena_t arena;
+	lush_arena_init(&arena);
+	char **commands = lush_split_pipes(&arena, line);
+	lush_redirect_t **redirects;
+	int status = 0;
+	char ***args = lush_split_args(&arena, commands, &redirects, &status);
+
+	uint64_t start = now_ns();
+	run_quiet(args, redirects, status);
+	double seconds = (now_ns() - start) / 1e9;
+	report("pipeline", "throughput", PIPELINE_BYTES / seconds / 1e6, "MB/s");
+	lush_arena_free(&arena);
+}
+
+static double spawn_lush(const char *lush_bin) {
+	char *args[] = {(char *)lush_bin, "-c", "true", NULL};
+	uint64_t start = now_ns();
+	pid_t pid;
+	if (posix_spawn(&pid, lush_bin, NULL, NULL, args, environ) != 0)
+		return -1;
+	waitpid(pid, NULL, 0);
+	return (now_ns() - start) / 1e6;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static void bench_startup() {
+	const char *lush_bin = getenv("LUSH_BIN");
+	if (lush_bin == NULL)
+		lush_bin = "bin/Release/lush/lush";
+	if (access(lush_bin, X_OK) != 0) {
+		fprintf(stderr, "lush-bench: startup: %s not found, set LUSH_BIN\n",
+				lush_bin);
+		return;
+	}
+
+	// the first run pays for page cache misses, the rest show the median
+	report("startup", "first_ms", spawn_lush(lush_bin), "ms");
+	double times[STARTUP_RUNS];
+	for (int i = 0; i < STARTUP_RUNS; i++)
+		times[i] = spawn_lush(lush_bin);
+	qsort(times, STARTUP_RUNS, sizeof(double), compare_doubles);
+	report("startup", "median_ms", times[STARTUP_RUNS / 2], "ms");
+}
+
+static pid_t helper_spawn(char **args, int output_fd) {
+	int error;
+	pid_t pid = lush_spawn_helper_spawn(args[0], args, environ, STDIN_FILENO,
+										output_fd, STDERR_FILENO, -1, &error);
+	if (pid == -1) {
+		fprintf(stderr, "lush-bench: spawn_helper: %s: %s\n", args[0],
+				error ? strerror(error) : "helper not running");
+		exit(1);
+	}
+	return pid;
+}
+
+static void check_helper_context() {
+	// the helper was forked before these changed, commands must still see
+	// the shell's current directory and umask
+	char dir[] = "/tmp/lush-bench-XXXXXX";
+	if (mkdtemp(dir) == NULL || chdir(dir) != 0) {
+		perror("lush-bench: spawn_helper");
+		exit(1);
+	}
+	mode_t old_mask = umask(077);
+
+	int fds[2];
+	if (pipe(fds) == -1) {
+		perror("pipe");
+		exit(1);
+	}
+	char *pwd_args[] = {"/bin/pwd", NULL};
+	pid_t pid = helper_spawn(pwd_args, fds[1]);
+	close(fds[1]);
+	char output[4096] = {0};
+	ssize_t len = read(fds[0], output, sizeof(output) - 1);
+	close(fds[0]);
+	waitpid(pid, NULL, 0);
+	if (len > 0 && output[len - 1] == '\n')
+		output[len - 1] = '\0';
+
+	char *touch_args[] = {"/usr/bin/touch", "file", NULL};
+	waitpid(helper_spawn(touch_args, STDOUT_FILENO), NULL, 0);
+	struct stat st;
+	bool mask_kept = stat("file", &st) == 0 && (st.st_mode & 0777) == 0600;
+
+	unlink("file");
+	umask(old_mask);
+	if (chdir("/") == 0)
+		rmdir(dir);
+	if (strcmp(output, dir) != 0 || !mask_kept) {
+		fprintf(stderr,
+				"lush-bench: spawn_helper: started in %s instead of %s%s\n",
+				output, dir, mask_kept ? "" : ", umask was not passed on");
+		exit(1);
+	}
+}
+
+static void bench_spawn_helper() {
+	setenv("LUSH_SPAWN_HELPER", "1", 1);
+	lush_spawn_helper_init();
+	if (!lush_spawn_helper_running()) {
+		fprintf(stderr, "lush-bench: spawn_helper: helper did not start\n");
+		exit(1);
+	}
+	char cwd[4096];
+	if (getcwd(cwd, sizeof(cwd)) == NULL) {
+		perror("getcwd");
+		exit(1);
+	}
+	check_helper_context();
+	if (chdir(cwd) != 0)
+		perror("chdir");
+
+	char *args[] = {"/bin/true", NULL};
+	uint64_t start = now_ns();
+	for (int i = 0; i < HELPER_RUNS; i++)
+		waitpid(helper_spawn(args, STDOUT_FILENO), NULL, 0);
+	report("spawn_helper", "round_trip_us",
+		   (now_ns() - start) / 1e3 / HELPER_RUNS, "us");
+}
+
+static const bench_case_t cases[] = {
+	{"parse", bench_parse},
+	{"history_512", bench_history_512},
+	{"history_10k", bench_history_10k},
+	{"history_100k", bench_history_100k},
+	{"exec", bench_exec},
+	{"pipeline", bench_pipeline},
+	{"startup", bench_startup},
+	{"spawn_helper", bench_spawn_helper},
+	{NULL, NULL},
+};
+
+int main(int argc, char *argv[]) {
+	for (const bench_case_t *bench = cases; bench->name; bench++) {
+		bool selected = argc == 1;
+		for (int i = 1; i < argc; i++) {
+			if (strcmp(argv[i], bench->name) == 0)
+				selected = true;
+		}
+		if (selected)
+			bench->run();
+	}
+	return 0;
+}
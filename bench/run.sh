@@ -0,0 +1,13 @@
+#!/bin/sh
+# builds the release binaries and runs the benchmarks, results are one JSON
+# object per line, written to the file given or to stdout
+# usage: bench/run.sh [results.jsonl] [case ...]
+set -e
+cd "$(dirname "$0")/.."
+
+premake5 gmake
+make config=release
+
+out=${1:-/dev/stdout}
+[ $# -gt 0 ] && shift
+LUSH_BIN=bin/Release/lush/lush bin/Release/lush-bench/lush-bench "$@" >"$out"
@@ -1,36 +1,56 @@
 workspace("lush")
 configurations({ "Debug", "Release" })
 
--- lush project
-project("lush")
-kind("ConsoleApp")
-language("C")
-targetdir("bin/%{cfg.buildcfg}/lush")
-
 local lua_inc_path = "/usr/include"
 local lua_lib_path = "/usr/lib"
+local lua_lib = "lua"
 
 if os.findlib("lua5.4") then
 	lua_inc_path = "/usr/include/lua5.4"
 	lua_lib_path = "/usr/lib/5.4"
-	links({ "lua5.4" })
-else
-	links({ "lua" })
+	lua_lib = "lua5.4"
 end
 
-includedirs({ lua_inc_path })
-libdirs({ lua_lib_path })
+-- settings shared by the shell and the benchmarks
+local function lush_settings()
+	language("C")
+	links({ lua_lib, "m" })
+	includedirs({ lua_inc_path })
+	libdirs({ lua_lib_path })
+	defines({ 'LUSH_VERSION="0.0.1"' })
+
+	filter("configurations:Debug")
+	defines({ "DEBUG" })
+	symbols("On")
+
+	filter("configurations:Release")
+	defines({ "NDEBUG" })
+	optimize("On")
+
+	filter({})
+end
+
+-- lush project
+project("lush")
+kind("ConsoleApp")
+targetdir("bin/%{cfg.buildcfg}/lush")
 
 files({
 	"src/**.h",
 	"src/**.c",
 })
-defines({ 'LUSH_VERSION="0.0.1"' })
+lush_settings()
 
-filter("configurations:Debug")
-defines({ "DEBUG" })
-symbols("On")
+-- micro benchmarks, bench/run.sh builds and runs them
+project("lush-bench")
+kind("ConsoleApp")
+targetdir("bin/%{cfg.buildcfg}/lush-bench")
 
-filter("configurations:Release")
-defines({ "NDEBUG" })
-optimize("On")
+files({
+	"src/**.h",
+	"src/**.c",
+	"bench/**.c",
+})
+includedirs({ "src" })
+defines({ "LUSH_BENCH" })
+lush_settings()
@@ -0,0 +1,139 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "arena.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_CHUNK_SIZE 4096
+#define ARENA_ALIGNMENT 16
+
+static lush_arena_chunk_t *new_chunk(size_t size) {
+	if (size < ARENA_CHUNK_SIZE)
+		size = ARENA_CHUNK_SIZE;
+	lush_arena_chunk_t *chunk = malloc(sizeof(lush_arena_chunk_t) + size);
+	if (chunk == NULL) {
+		perror("malloc failed");
+		exit(1);
+	}
+	chunk->next = NULL;
+	chunk->size = size;
+	chunk->used = 0;
+	return chunk;
+}
+
+void lush_arena_init(lush_arena_t *arena) {
+	arena->head = NULL;
+	arena->current = NULL;
+}
+
+void lush_arena_free(lush_arena_t *arena) {
+	lush_arena_chunk_t *chunk = arena->head;
+	while (chunk) {
+		lush_arena_chunk_t *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	arena->head = NULL;
+	arena->current = NULL;
+}
+
+void lush_arena_reset(lush_arena_t *arena) {
+	if (arena->head == NULL)
+		return;
+
+	// a single huge line should not pin its memory forever
+	lush_arena_chunk_t *chunk = arena->head->next;
+	while (chunk) {
+		lush_arena_chunk_t *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	arena->head->next = NULL;
+	arena->head->used = 0;
+	arena->current = arena->head;
+}
+
+void *lush_arena_alloc(lush_arena_t *arena, size_t size) {
+	size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+	if (arena->current == NULL) {
+		arena->head = new_chunk(size);
+		arena->current = arena->head;
+	}
+
+	lush_arena_chunk_t *chunk = arena->current;
+	if (chunk->size - chunk->used < size) {
+		// reuse the next chunk left over from a released mark if it fits
+		if (chunk->next && chunk->next->size >= size) {
+			chunk = chunk->next;
+		} else {
+			lush_arena_chunk_t *fresh = new_chunk(size);
+			fresh->next = chunk->next;
+			chunk->next = fresh;
+			chunk = fresh;
+		}
+		chunk->used = 0;
+		arena->current = chunk;
+	}
+
+	void *ptr = chunk->data + chunk->used;
+	chunk->used += size;
+	return ptr;
+}
+
+void *lush_arena_calloc(lush_arena_t *arena, size_t count, size_t size) {
+	if (size != 0 && count > SIZE_MAX / size) {
+		fprintf(stderr, "lush: arena allocation too large\n");
+		exit(1);
+	}
+	void *ptr = lush_arena_alloc(arena, count * size);
+	memset(ptr, 0, count * size);
+	return ptr;
+}
+
+char *lush_arena_strndup(lush_arena_t *arena, const char *str, size_t len) {
+	char *copy = lush_arena_alloc(arena, len + 1);
+	memcpy(copy, str, len);
+	copy[len] = '\0';
+	return copy;
+}
+
+char *lush_arena_strdup(lush_arena_t *arena, const char *str) {
+	return lush_arena_strndup(arena, str, strlen(str));
+}
+
+lush_arena_mark_t lush_arena_mark(lush_arena_t *arena) {
+	lush_arena_mark_t mark = {arena->current,
+							  arena->current ? arena->current->used : 0};
+	return mark;
+}
+
+void lush_arena_release(lush_arena_t *arena, lush_arena_mark_t mark) {
+	if (mark.chunk == NULL) {
+		// marked before anything was allocated
+		if (arena->head) {
+			arena->head->used = 0;
+			arena->current = arena->head;
+		}
+		return;
+	}
+	mark.chunk->used = mark.used;
+	arena->current = mark.chunk;
+}
@@ -0,0 +1,56 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+typedef struct lush_arena_chunk {
+	struct lush_arena_chunk *next;
+	size_t size;
+	size_t used;
+	// aligned so any type can be carved out of it
+	_Alignas(16) char data[];
+} lush_arena_chunk_t;
+
+// bump allocator for everything that lives as long as one command line
+typedef struct {
+	lush_arena_chunk_t *head;
+	lush_arena_chunk_t *current;
+} lush_arena_t;
+
+// position to roll back to, lets nested command lines share an arena
+typedef struct {
+	lush_arena_chunk_t *chunk;
+	size_t used;
+} lush_arena_mark_t;
+
+void lush_arena_init(lush_arena_t *arena);
+void lush_arena_free(lush_arena_t *arena);
+// release everything at once, keeping the first chunk for reuse
+void lush_arena_reset(lush_arena_t *arena);
+
+void *lush_arena_alloc(lush_arena_t *arena, size_t size);
+void *lush_arena_calloc(lush_arena_t *arena, size_t count, size_t size);
+char *lush_arena_strdup(lush_arena_t *arena, const char *str);
+char *lush_arena_strndup(lush_arena_t *arena, const char *str, size_t len);
+
+lush_arena_mark_t lush_arena_mark(lush_arena_t *arena);
+void lush_arena_release(lush_arena_t *arena, lush_arena_mark_t mark);
+
+#endif // ARENA_H
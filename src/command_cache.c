@@ -0,0 +1,119 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "command_cache.h"
+#include "hashmap.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define COMMAND_CACHE_SIZE 64
+
+static lush_hashmap_t cache_map;
+static bool cache_ready = false;
+static lush_cached_line_t *lru_head = NULL;
+static lush_cached_line_t *lru_tail = NULL;
+
+static void lru_unlink(lush_cached_line_t *entry) {
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		lru_head = entry->next;
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	else
+		lru_tail = entry->prev;
+	entry->prev = NULL;
+	entry->next = NULL;
+}
+
+static void lru_push_front(lush_cached_line_t *entry) {
+	entry->prev = NULL;
+	entry->next = lru_head;
+	if (lru_head)
+		lru_head->prev = entry;
+	lru_head = entry;
+	if (lru_tail == NULL)
+		lru_tail = entry;
+}
+
+static void free_entry(lush_cached_line_t *entry) {
+	lush_arena_free(&entry->arena);
+	free(entry);
+}
+
+static void evict() {
+	// drop the oldest entries that nothing is running right now
+	lush_cached_line_t *entry = lru_tail;
+	while (cache_map.count > COMMAND_CACHE_SIZE && entry) {
+		lush_cached_line_t *prev = entry->prev;
+		if (entry->refs == 0) {
+			lush_hashmap_remove(&cache_map, entry->text);
+			lru_unlink(entry);
+			free_entry(entry);
+		}
+		entry = prev;
+	}
+}
+
+lush_cached_line_t *lush_cache_acquire(const char *line) {
+	if (!cache_ready) {
+		lush_hashmap_init(&cache_map, NULL);
+		cache_ready = true;
+	}
+
+	lush_cached_line_t *entry = lush_hashmap_get(&cache_map, line);
+	if (entry) {
+		lru_unlink(entry);
+		lru_push_front(entry);
+		entry->refs++;
+		return entry;
+	}
+
+	entry = malloc(sizeof(lush_cached_line_t));
+	if (entry == NULL) {
+		perror("malloc");
+		return NULL;
+	}
+	lush_arena_init(&entry->arena);
+	entry->prev = NULL;
+	entry->next = NULL;
+	entry->refs = 0;
+	entry->text = lush_arena_strdup(&entry->arena, line);
+	if (lush_compile_line(&entry->arena, line, &entry->cmdline) == -1) {
+		free_entry(entry);
+		return NULL;
+	}
+
+	if (!lush_hashmap_put(&cache_map, entry->text, entry)) {
+		// still usable, just not cached
+		entry->refs = -1;
+		return entry;
+	}
+	lru_push_front(entry);
+	entry->refs++;
+	evict();
+	return entry;
+}
+
+void lush_cache_release(lush_cached_line_t *entry) {
+	if (entry->refs == -1) {
+		free_entry(entry);
+		return;
+	}
+	entry->refs--;
+}
@@ -0,0 +1,39 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef COMMAND_CACHE_H
+#define COMMAND_CACHE_H
+
+#include "arena.h"
+#include "lush.h"
+
+typedef struct lush_cached_line {
+	// least recently used order, most recent at the head
+	struct lush_cached_line *prev;
+	struct lush_cached_line *next;
+	char *text;
+	lush_arena_t arena;
+	lush_cmdline_t cmdline;
+	// entries that are being run are never evicted
+	int refs;
+} lush_cached_line_t;
+
+// parse a line or reuse an earlier parse, NULL if the line does not parse
+lush_cached_line_t *lush_cache_acquire(const char *line);
+void lush_cache_release(lush_cached_line_t *entry);
+
+#endif // COMMAND_CACHE_H
@@ -0,0 +1,195 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "completion.h"
+#include "path_hash.h"
+#include "vars.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+typedef struct {
+	char *name;
+	bool is_dir;
+} dir_entry_t;
+
+// the last directory completed in, kept while its mtime stays the same so
+// typing more of a name never reads the directory again
+typedef struct {
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	dir_entry_t *entries;
+	size_t count;
+} dir_cache_t;
+
+static dir_cache_t dir_cache = {NULL, 0, 0, {0, 0}, NULL, 0};
+
+static void add_match(lush_completion_t *out, const char *prefix,
+					  size_t prefix_len, const char *name, bool is_dir) {
+	if (out->count == out->cap) {
+		size_t new_cap = out->cap ? out->cap * 2 : 16;
+		char **matches = realloc(out->matches, new_cap * sizeof(char *));
+		if (matches == NULL) {
+			perror("realloc failed");
+			exit(1);
+		}
+		out->matches = matches;
+		out->cap = new_cap;
+	}
+	size_t name_len = strlen(name);
+	char *match = malloc(prefix_len + name_len + 2);
+	if (match == NULL) {
+		perror("malloc failed");
+		exit(1);
+	}
+	memcpy(match, prefix, prefix_len);
+	memcpy(match + prefix_len, name, name_len);
+	match[prefix_len + name_len] = is_dir ? '/' : '\0';
+	match[prefix_len + name_len + 1] = '\0';
+	out->matches[out->count++] = match;
+}
+
+void lush_completion_free(lush_completion_t *completion) {
+	for (size_t i = 0; i < completion->count; i++)
+		free(completion->matches[i]);
+	free(completion->matches);
+	completion->matches = NULL;
+	completion->count = 0;
+	completion->cap = 0;
+}
+
+static void clear_dir_cache() {
+	for (size_t i = 0; i < dir_cache.count; i++)
+		free(dir_cache.entries[i].name);
+	free(dir_cache.entries);
+	free(dir_cache.path);
+	dir_cache = (dir_cache_t){NULL, 0, 0, {0, 0}, NULL, 0};
+}
+
+static int compare_entries(const void *a, const void *b) {
+	return strcmp(((const dir_entry_t *)a)->name,
+				  ((const dir_entry_t *)b)->name);
+}
+
+static bool load_dir(const char *path) {
+	struct stat st;
+	if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+		return false;
+	// the path alone is not enough since relative ones move with cd
+	if (dir_cache.path && strcmp(dir_cache.path, path) == 0 &&
+		dir_cache.dev == st.st_dev && dir_cache.ino == st.st_ino &&
+		dir_cache.mtime.tv_sec == st.st_mtim.tv_sec &&
+		dir_cache.mtime.tv_nsec == st.st_mtim.tv_nsec)
+		return true;
+
+	clear_dir_cache();
+	DIR *handle = opendir(path);
+	if (handle == NULL)
+		return false;
+	dir_cache.path = strdup(path);
+	dir_cache.dev = st.st_dev;
+	dir_cache.ino = st.st_ino;
+	dir_cache.mtime = st.st_mtim;
+
+	int fd = dirfd(handle);
+	size_t cap = 0;
+	struct dirent *entry;
+	while ((entry = readdir(handle)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+		if (dir_cache.count == cap) {
+			cap = cap ? cap * 2 : 64;
+			dir_entry_t *entries =
+				realloc(dir_cache.entries, cap * sizeof(dir_entry_t));
+			if (entries == NULL) {
+				perror("realloc failed");
+				exit(1);
+			}
+			dir_cache.entries = entries;
+		}
+		bool is_dir = entry->d_type == DT_DIR;
+		struct stat entry_st;
+		if ((entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) &&
+			fstatat(fd, entry->d_name, &entry_st, 0) == 0)
+			is_dir = S_ISDIR(entry_st.st_mode);
+		dir_cache.entries[dir_cache.count].name = strdup(entry->d_name);
+		dir_cache.entries[dir_cache.count++].is_dir = is_dir;
+	}
+	closedir(handle);
+
+	qsort(dir_cache.entries, dir_cache.count, sizeof(dir_entry_t),
+		  compare_entries);
+	return true;
+}
+
+static void complete_path(const char *word, lush_completion_t *out) {
+	const char *slash = strrchr(word, '/');
+	size_t dir_len = slash ? (size_t)(slash - word) + 1 : 0;
+	const char *base = word + dir_len;
+	size_t base_len = strlen(base);
+
+	// the word keeps its ~ while the listing needs the real directory
+	char path[PATH_MAX];
+	const char *home = lush_var_get("HOME");
+	if (dir_len == 0)
+		snprintf(path, sizeof(path), ".");
+	else if (word[0] == '~' && word[1] == '/' && home)
+		snprintf(path, sizeof(path), "%s%.*s", home, (int)dir_len - 1,
+				 word + 1);
+	else
+		snprintf(path, sizeof(path), "%.*s", (int)dir_len, word);
+	if (!load_dir(path))
+		return;
+
+	// entries are sorted so the matches start at the first one not below base
+	size_t low = 0;
+	size_t high = dir_cache.count;
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+		if (strncmp(dir_cache.entries[mid].name, base, base_len) < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	for (size_t i = low; i < dir_cache.count; i++) {
+		const dir_entry_t *entry = &dir_cache.entries[i];
+		if (strncmp(entry->name, base, base_len) != 0)
+			break;
+		// hidden files are only offered once a dot was typed
+		if (entry->name[0] == '.' && base[0] != '.')
+			continue;
+		add_match(out, word, dir_len, entry->name, entry->is_dir);
+	}
+}
+
+size_t lush_complete(const char *word, bool command, lush_completion_t *out) {
+	if (command && strchr(word, '/') == NULL) {
+		size_t count;
+		const char *const *names = lush_path_complete(word, &count);
+		for (size_t i = 0; i < count; i++)
+			add_match(out, "", 0, names[i], false);
+	} else {
+		complete_path(word, out);
+	}
+	return out->count;
+}
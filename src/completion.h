@@ -0,0 +1,36 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef COMPLETION_H
+#define COMPLETION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct {
+	// full replacements for the word, directories end in a slash
+	char **matches;
+	size_t count;
+	size_t cap;
+} lush_completion_t;
+
+// fills out with the candidates for word, command names from the PATH
+// index when it starts a command and paths otherwise
+size_t lush_complete(const char *word, bool command, lush_completion_t *out);
+void lush_completion_free(lush_completion_t *completion);
+
+#endif // COMPLETION_H
@@ -0,0 +1,166 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "event_loop.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 64
+// how often pid watches without a pidfd are checked
+#define FALLBACK_TICK_MS 10
+
+static int epoll_fd = -1;
+static lush_watch_t *watches = NULL;
+static int num_watches = 0;
+// pid watches without a pidfd, they get called on every tick
+static int num_fallback = 0;
+// watches are only freed outside of dispatch so callbacks can unwatch
+static int dispatch_depth = 0;
+static bool has_inactive = false;
+
+int lush_pidfd_open(pid_t pid) {
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	return -1;
+#endif
+}
+
+static bool ensure_epoll() {
+	if (epoll_fd != -1)
+		return true;
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd == -1) {
+		perror("epoll_create1");
+		return false;
+	}
+	return true;
+}
+
+static lush_watch_t *add_watch(int fd, pid_t pid, lush_event_fn fn,
+							   void *data) {
+	if (!ensure_epoll())
+		return NULL;
+
+	lush_watch_t *watch = malloc(sizeof(lush_watch_t));
+	if (watch == NULL) {
+		perror("malloc failed");
+		exit(1);
+	}
+	watch->fd = fd;
+	watch->pid = pid;
+	watch->active = true;
+	watch->fn = fn;
+	watch->data = data;
+
+	if (fd != -1) {
+		struct epoll_event ev = {.events = EPOLLIN, .data.ptr = watch};
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+			perror("epoll_ctl");
+			free(watch);
+			return NULL;
+		}
+	} else {
+		num_fallback++;
+	}
+
+	watch->next = watches;
+	watches = watch;
+	num_watches++;
+	return watch;
+}
+
+lush_watch_t *lush_loop_watch_fd(int fd, lush_event_fn fn, void *data) {
+	return add_watch(fd, 0, fn, data);
+}
+
+lush_watch_t *lush_loop_watch_pid(pid_t pid, lush_event_fn fn, void *data) {
+	int pidfd = lush_pidfd_open(pid);
+	lush_watch_t *watch = add_watch(pidfd, pid, fn, data);
+	if (watch == NULL && pidfd != -1)
+		close(pidfd);
+	return watch;
+}
+
+void lush_loop_unwatch(lush_watch_t *watch) {
+	if (watch == NULL || !watch->active)
+		return;
+	watch->active = false;
+	num_watches--;
+	if (watch->fd == -1) {
+		num_fallback--;
+	} else {
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL);
+		if (watch->pid > 0)
+			close(watch->fd);
+	}
+	has_inactive = true;
+}
+
+int lush_loop_count() { return num_watches; }
+
+static void free_inactive() {
+	lush_watch_t **link = &watches;
+	while (*link) {
+		lush_watch_t *watch = *link;
+		if (!watch->active) {
+			*link = watch->next;
+			free(watch);
+		} else {
+			link = &watch->next;
+		}
+	}
+	has_inactive = false;
+}
+
+int lush_loop_run_once(int timeout_ms) {
+	if (!ensure_epoll())
+		return -1;
+	if (num_fallback > 0 && (timeout_ms == -1 || timeout_ms > FALLBACK_TICK_MS))
+		timeout_ms = FALLBACK_TICK_MS;
+
+	struct epoll_event events[MAX_EVENTS];
+	int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout_ms);
+	if (n == -1) {
+		if (errno == EINTR)
+			return 0;
+		perror("epoll_wait");
+		return -1;
+	}
+
+	dispatch_depth++;
+	for (int i = 0; i < n; i++) {
+		lush_watch_t *watch = events[i].data.ptr;
+		if (watch->active)
+			watch->fn(watch->data, events[i].events);
+	}
+	if (num_fallback > 0) {
+		for (lush_watch_t *watch = watches; watch; watch = watch->next) {
+			if (watch->active && watch->fd == -1)
+				watch->fn(watch->data, 0);
+		}
+	}
+	dispatch_depth--;
+
+	if (dispatch_depth == 0 && has_inactive)
+		free_inactive();
+	return n;
+}
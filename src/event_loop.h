@@ -0,0 +1,51 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// called with the epoll events that fired, or 0 on a fallback tick
+typedef void (*lush_event_fn)(void *data, uint32_t events);
+
+typedef struct lush_watch {
+	int fd;
+	// set for pid watches, the pidfd is owned by the watch
+	pid_t pid;
+	bool active;
+	lush_event_fn fn;
+	void *data;
+	struct lush_watch *next;
+} lush_watch_t;
+
+// pidfd for pid, or -1 if the kernel cannot provide one
+int lush_pidfd_open(pid_t pid);
+// call fn whenever fd is readable, the fd itself stays owned by the caller
+lush_watch_t *lush_loop_watch_fd(int fd, lush_event_fn fn, void *data);
+// call fn once pid has exited, fn has to reap it with lush_try_wait and may
+// be called early on kernels without pidfds
+lush_watch_t *lush_loop_watch_pid(pid_t pid, lush_event_fn fn, void *data);
+void lush_loop_unwatch(lush_watch_t *watch);
+// number of watches still registered
+int lush_loop_count();
+// wait up to timeout_ms (-1 forever) and dispatch whatever is ready
+int lush_loop_run_once(int timeout_ms);
+
+#endif // EVENT_LOOP_H
@@ -0,0 +1,249 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "glob.h"
+#include <dirent.h>
+#include <fnmatch.h>
+#include <linux/limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+typedef struct {
+	size_t count;
+	char **names;
+	unsigned char *types;
+} dir_listing_t;
+
+static void free_listing(void *value) {
+	dir_listing_t *listing = value;
+	for (size_t i = 0; i < listing->count; i++)
+		free(listing->names[i]);
+	free(listing->names);
+	free(listing->types);
+	free(listing);
+}
+
+void lush_glob_cache_init(lush_glob_cache_t *cache) {
+	lush_hashmap_init(&cache->listings, free_listing);
+}
+
+void lush_glob_cache_free(lush_glob_cache_t *cache) {
+	lush_hashmap_free(&cache->listings);
+}
+
+void lush_glob_result_free(lush_glob_result_t *result) {
+	for (size_t i = 0; i < result->count; i++)
+		free(result->paths[i]);
+	free(result->paths);
+	result->paths = NULL;
+	result->count = 0;
+	result->cap = 0;
+}
+
+bool lush_has_glob(const char *str) { return strpbrk(str, "*?[") != NULL; }
+
+static const dir_listing_t *list_dir(lush_glob_cache_t *cache,
+									 const char *dir) {
+	// every directory is read once per cache no matter how many patterns
+	// walk through it, d_type saves a stat for most entries
+	dir_listing_t *listing = lush_hashmap_get(&cache->listings, dir);
+	if (listing)
+		return listing;
+
+	listing = calloc(1, sizeof(dir_listing_t));
+	if (listing == NULL) {
+		perror("calloc failed");
+		exit(1);
+	}
+	DIR *handle = opendir(*dir ? dir : ".");
+	if (handle) {
+		size_t cap = 0;
+		struct dirent *entry;
+		while ((entry = readdir(handle)) != NULL) {
+			if (strcmp(entry->d_name, ".") == 0 ||
+				strcmp(entry->d_name, "..") == 0)
+				continue;
+			if (listing->count == cap) {
+				cap = cap ? cap * 2 : 32;
+				char **names = realloc(listing->names, cap * sizeof(char *));
+				unsigned char *types = realloc(listing->types, cap);
+				if (!names || !types) {
+					perror("realloc failed");
+					exit(1);
+				}
+				listing->names = names;
+				listing->types = types;
+			}
+			listing->names[listing->count] = strdup(entry->d_name);
+			listing->types[listing->count++] = entry->d_type;
+		}
+		closedir(handle);
+	}
+	// unreadable directories are cached as empty ones
+	lush_hashmap_put(&cache->listings, dir, listing);
+	return listing;
+}
+
+static bool join_path(char *path, const char *base, const char *name) {
+	int len;
+	if (*base == '\0')
+		len = snprintf(path, PATH_MAX, "%s", name);
+	else if (strcmp(base, "/") == 0)
+		len = snprintf(path, PATH_MAX, "/%s", name);
+	else
+		len = snprintf(path, PATH_MAX, "%s/%s", base, name);
+	return len < PATH_MAX;
+}
+
+static bool is_dir(const char *path, unsigned char type, bool follow_links) {
+	if (type == DT_DIR)
+		return true;
+	if (type == DT_LNK && !follow_links)
+		return false;
+	if (type != DT_UNKNOWN && type != DT_LNK)
+		return false;
+	struct stat st;
+	int rc = follow_links ? stat(path, &st) : lstat(path, &st);
+	return rc == 0 && S_ISDIR(st.st_mode);
+}
+
+static void add_path(lush_glob_result_t *result, const char *path) {
+	if (result->count == result->cap) {
+		size_t new_cap = result->cap ? result->cap * 2 : 16;
+		char **paths = realloc(result->paths, new_cap * sizeof(char *));
+		if (paths == NULL) {
+			perror("realloc failed");
+			exit(1);
+		}
+		result->paths = paths;
+		result->cap = new_cap;
+	}
+	result->paths[result->count++] = strdup(path);
+}
+
+static void add_match(lush_glob_result_t *result, const char *path,
+					  bool dirs_only) {
+	// a pattern ending in / keeps it on every directory it matched, paths
+	// are shorter than PATH_MAX so the slash always fits
+	if (!dirs_only) {
+		add_path(result, path);
+		return;
+	}
+	char dir[PATH_MAX + 1];
+	snprintf(dir, sizeof(dir), "%s/", path);
+	add_path(result, dir);
+}
+
+static void expand_segments(lush_glob_cache_t *cache, const char *base,
+							char **segments, int index, int num_segments,
+							bool dirs_only, lush_glob_result_t *result) {
+	const char *segment = segments[index];
+	bool last = index == num_segments - 1;
+	char path[PATH_MAX];
+
+	if (!lush_has_glob(segment)) {
+		// plain names need no listing at all
+		if (!join_path(path, base, segment))
+			return;
+		struct stat st;
+		if (!last)
+			expand_segments(cache, path, segments, index + 1, num_segments,
+							dirs_only, result);
+		else if (dirs_only ? stat(path, &st) == 0 && S_ISDIR(st.st_mode)
+						   : lstat(path, &st) == 0)
+			add_match(result, path, dirs_only);
+		return;
+	}
+
+	const dir_listing_t *listing = list_dir(cache, base);
+	if (strcmp(segment, "**") == 0) {
+		// zero directories first, then every directory below base, links
+		// are not followed so a loop can never be walked forever
+		if (!last)
+			expand_segments(cache, base, segments, index + 1, num_segments,
+							dirs_only, result);
+		for (size_t i = 0; i < listing->count; i++) {
+			if (listing->names[i][0] == '.' ||
+				!join_path(path, base, listing->names[i]))
+				continue;
+			bool dir = is_dir(path, listing->types[i], false);
+			if (last && (dir || !dirs_only))
+				add_match(result, path, dirs_only);
+			if (dir)
+				expand_segments(cache, path, segments, index, num_segments,
+								dirs_only, result);
+		}
+		return;
+	}
+
+	for (size_t i = 0; i < listing->count; i++) {
+		// hidden files only match a pattern that starts with a dot
+		if (fnmatch(segment, listing->names[i], FNM_PERIOD) != 0 ||
+			!join_path(path, base, listing->names[i]))
+			continue;
+		if (last && (!dirs_only || is_dir(path, listing->types[i], true)))
+			add_match(result, path, dirs_only);
+		else if (!last && is_dir(path, listing->types[i], true))
+			expand_segments(cache, path, segments, index + 1, num_segments,
+							dirs_only, result);
+	}
+}
+
+static int compare_paths(const void *a, const void *b) {
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+size_t lush_glob(lush_glob_cache_t *cache, const char *pattern,
+				 lush_glob_result_t *result) {
+	char *copy = strdup(pattern);
+	if (copy == NULL) {
+		perror("strdup failed");
+		return 0;
+	}
+
+	// a pattern has at most one segment per slash
+	int max_segments = 1;
+	for (const char *c = pattern; *c; c++) {
+		if (*c == '/')
+			max_segments++;
+	}
+	char **segments = malloc(max_segments * sizeof(char *));
+	if (segments == NULL) {
+		perror("malloc failed");
+		exit(1);
+	}
+	int num_segments = 0;
+	for (char *segment = strtok(copy, "/"); segment;
+		 segment = strtok(NULL, "/"))
+		segments[num_segments++] = segment;
+
+	// strtok drops a trailing /, which only lets directories match
+	size_t len = strlen(pattern);
+	bool dirs_only = len > 1 && pattern[len - 1] == '/';
+	size_t first = result->count;
+	if (num_segments > 0)
+		expand_segments(cache, *pattern == '/' ? "/" : "", segments, 0,
+						num_segments, dirs_only, result);
+	qsort(result->paths + first, result->count - first, sizeof(char *),
+		  compare_paths);
+
+	free(segments);
+	free(copy);
+	return result->count - first;
+}
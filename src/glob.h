@@ -0,0 +1,47 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef GLOB_H
+#define GLOB_H
+
+#include "hashmap.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct {
+	char **paths;
+	size_t count;
+	size_t cap;
+} lush_glob_result_t;
+
+// directory listings read while expanding, meant to live for one line
+typedef struct {
+	lush_hashmap_t listings;
+} lush_glob_cache_t;
+
+void lush_glob_cache_init(lush_glob_cache_t *cache);
+void lush_glob_cache_free(lush_glob_cache_t *cache);
+void lush_glob_result_free(lush_glob_result_t *result);
+
+// true if str has any of * ? [ that would make it a pattern
+bool lush_has_glob(const char *str);
+// appends every path matching pattern in sorted order, ** matches any
+// number of directories, returns the number of paths added
+size_t lush_glob(lush_glob_cache_t *cache, const char *pattern,
+				 lush_glob_result_t *result);
+
+#endif // GLOB_H
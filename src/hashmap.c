@@ -0,0 +1,170 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "hashmap.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HASHMAP_INITIAL_CAPACITY 16
+
+static uint64_t hash_key(const char *key) {
+	// FNV-1a
+	uint64_t hash = 14695981039346656037ULL;
+	for (const unsigned char *c = (const unsigned char *)key; *c; c++) {
+		hash ^= *c;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static size_t find_slot(const lush_hashmap_t *map, const char *key) {
+	// capacity is a power of two so the mask replaces a modulo
+	size_t mask = map->capacity - 1;
+	size_t i = hash_key(key) & mask;
+	while (map->entries[i].key && strcmp(map->entries[i].key, key) != 0) {
+		i = (i + 1) & mask;
+	}
+	return i;
+}
+
+static bool grow(lush_hashmap_t *map) {
+	size_t new_capacity =
+		map->capacity ? map->capacity * 2 : HASHMAP_INITIAL_CAPACITY;
+	lush_hashmap_entry_t *entries =
+		calloc(new_capacity, sizeof(lush_hashmap_entry_t));
+	if (entries == NULL) {
+		perror("calloc failed");
+		return false;
+	}
+
+	lush_hashmap_entry_t *old_entries = map->entries;
+	size_t old_capacity = map->capacity;
+	map->entries = entries;
+	map->capacity = new_capacity;
+	for (size_t i = 0; i < old_capacity; i++) {
+		if (old_entries[i].key)
+			map->entries[find_slot(map, old_entries[i].key)] = old_entries[i];
+	}
+	free(old_entries);
+	return true;
+}
+
+void lush_hashmap_init(lush_hashmap_t *map, void (*free_value)(void *value)) {
+	map->entries = NULL;
+	map->capacity = 0;
+	map->count = 0;
+	map->free_value = free_value;
+}
+
+void lush_hashmap_clear(lush_hashmap_t *map) {
+	for (size_t i = 0; i < map->capacity; i++) {
+		if (map->entries[i].key) {
+			free(map->entries[i].key);
+			if (map->free_value)
+				map->free_value(map->entries[i].value);
+			map->entries[i].key = NULL;
+			map->entries[i].value = NULL;
+		}
+	}
+	map->count = 0;
+}
+
+void lush_hashmap_free(lush_hashmap_t *map) {
+	lush_hashmap_clear(map);
+	free(map->entries);
+	map->entries = NULL;
+	map->capacity = 0;
+}
+
+void *lush_hashmap_get(const lush_hashmap_t *map, const char *key) {
+	if (map->count == 0)
+		return NULL;
+	return map->entries[find_slot(map, key)].value;
+}
+
+bool lush_hashmap_put(lush_hashmap_t *map, const char *key, void *value) {
+	// keep the load factor under 3/4
+	if ((map->count + 1) * 4 > map->capacity * 3 && !grow(map))
+		return false;
+
+	lush_hashmap_entry_t *entry = &map->entries[find_slot(map, key)];
+	if (entry->key) {
+		if (map->free_value && entry->value != value)
+			map->free_value(entry->value);
+		entry->value = value;
+		return true;
+	}
+
+	entry->key = strdup(key);
+	if (entry->key == NULL) {
+		perror("strdup");
+		return false;
+	}
+	entry->value = value;
+	map->count++;
+	return true;
+}
+
+bool lush_hashmap_remove(lush_hashmap_t *map, const char *key) {
+	if (map->count == 0)
+		return false;
+
+	size_t mask = map->capacity - 1;
+	size_t i = find_slot(map, key);
+	if (map->entries[i].key == NULL)
+		return false;
+
+	free(map->entries[i].key);
+	if (map->free_value)
+		map->free_value(map->entries[i].value);
+	map->entries[i].key = NULL;
+	map->entries[i].value = NULL;
+	map->count--;
+
+	// shift the rest of the probe run back so lookups need no tombstones
+	size_t j = i;
+	while (true) {
+		j = (j + 1) & mask;
+		if (map->entries[j].key == NULL)
+			break;
+		size_t home = hash_key(map->entries[j].key) & mask;
+		// move the entry if its home slot is not within (i, j]
+		if ((j > i && (home <= i || home > j)) ||
+			(j < i && (home <= i && home > j))) {
+			map->entries[i] = map->entries[j];
+			map->entries[j].key = NULL;
+			map->entries[j].value = NULL;
+			i = j;
+		}
+	}
+	return true;
+}
+
+bool lush_hashmap_next(const lush_hashmap_t *map, size_t *iter,
+					   const char **key, void **value) {
+	while (*iter < map->capacity) {
+		lush_hashmap_entry_t *entry = &map->entries[(*iter)++];
+		if (entry->key) {
+			*key = entry->key;
+			*value = entry->value;
+			return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,50 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef HASHMAP_H
+#define HASHMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct {
+	char *key;
+	void *value;
+} lush_hashmap_entry_t;
+
+// string keyed open addressing table, keys are copied on insert
+typedef struct {
+	lush_hashmap_entry_t *entries;
+	size_t capacity;
+	size_t count;
+	// called on values that are replaced or removed, may be NULL
+	void (*free_value)(void *value);
+} lush_hashmap_t;
+
+void lush_hashmap_init(lush_hashmap_t *map, void (*free_value)(void *value));
+void lush_hashmap_free(lush_hashmap_t *map);
+void lush_hashmap_clear(lush_hashmap_t *map);
+
+void *lush_hashmap_get(const lush_hashmap_t *map, const char *key);
+bool lush_hashmap_put(lush_hashmap_t *map, const char *key, void *value);
+bool lush_hashmap_remove(lush_hashmap_t *map, const char *key);
+
+// iterate with *iter starting at 0, returns false once every entry was seen
+bool lush_hashmap_next(const lush_hashmap_t *map, size_t *iter,
+					   const char **key, void **value);
+
+#endif // HASHMAP_H
@@ -16,15 +16,50 @@ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
 */
 
 #include "history.h"
+#include "stats.h"
+#include "trace.h"
+#include <errno.h>
+#include <fcntl.h>
 #include <linux/limits.h>
 #include <pwd.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
-#define MAX_LINES 512
+// commands kept in memory unless HISTSIZE asks for another amount
+#define DEFAULT_HISTORY_SIZE 100000
+#define MAX_HISTORY_SIZE 10000000
+// three byte substrings are hashed into this many posting lists
+#define TRIGRAM_BUCKETS 65536
+
+// ring of the most recent commands, every command gets the next sequence
+// number and lives in slot seq % history_size while it is kept
+static char **history_lines = NULL;
+static int history_size = DEFAULT_HISTORY_SIZE;
+static int history_start = 0;
+static int history_count = 0;
+static unsigned int next_seq = 0;
+
+// sequence numbers of the commands holding a trigram in ascending order,
+// numbers of commands that left the ring are dropped lazily
+typedef struct {
+	unsigned int *seqs;
+	size_t count;
+	size_t cap;
+} posting_t;
+
+static posting_t trigram_index[TRIGRAM_BUCKETS];
+
+// append only log on disk, oldest command first, logs written before the
+// marker line existed list the newest command first
+#define HISTORY_MARKER "#lush-history oldest-first\n"
+static char *history_path = NULL;
+static int history_fd = -1;
+static int disk_lines = 0;
 
 static char *get_history_path() {
 	uid_t uid = getuid();
@@ -47,118 +82,343 @@ static char *get_history_path() {
 	return path;
 }
 
-char *lush_get_past_command(int pos) {
-	char *path = get_history_path();
-	if (access(path, F_OK) != 0) {
-		// file does not exist
-		perror("history file check");
-		free(path);
-		return NULL;
+static void open_history_log() {
+	history_fd =
+		open(history_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (history_fd == -1) {
+		perror("opening history file");
 	}
+}
 
-	// read file from the bottom
-	FILE *fp = fopen(path, "r");
-	if (!fp) {
-		perror("opening file");
-		free(path);
-		return NULL;
+static unsigned int first_seq() { return next_seq - history_count; }
+
+static const char *entry_at(unsigned int seq) {
+	return history_lines[seq % history_size];
+}
+
+static unsigned int trigram_bucket(const char *str) {
+	const unsigned char *c = (const unsigned char *)str;
+	unsigned int trigram = (c[0] << 16) | (c[1] << 8) | c[2];
+	return (trigram * 2654435761u) >> 16;
+}
+
+static void index_entry(unsigned int seq) {
+	const char *line = entry_at(seq);
+	size_t len = strlen(line);
+	for (size_t i = 0; i + 3 <= len; i++) {
+		posting_t *posting = &trigram_index[trigram_bucket(&line[i])];
+		// a trigram repeated within one command is listed once
+		if (posting->count > 0 && posting->seqs[posting->count - 1] == seq)
+			continue;
+		if (posting->count == posting->cap) {
+			// drop commands that fell out of the ring before growing
+			size_t stale = 0;
+			while (stale < posting->count && posting->seqs[stale] < first_seq())
+				stale++;
+			memmove(posting->seqs, posting->seqs + stale,
+					(posting->count - stale) * sizeof(unsigned int));
+			posting->count -= stale;
+		}
+		if (posting->count == posting->cap) {
+			size_t new_cap = posting->cap ? posting->cap * 2 : 8;
+			unsigned int *seqs =
+				realloc(posting->seqs, new_cap * sizeof(unsigned int));
+			if (seqs == NULL) {
+				perror("realloc");
+				return;
+			}
+			posting->seqs = seqs;
+			posting->cap = new_cap;
+		}
+		posting->seqs[posting->count++] = seq;
 	}
-	char *line = (char *)malloc(1024 * sizeof(char));
-	if (line == NULL) {
-		perror("malloc");
-		free(path);
-		return NULL;
+}
+
+static int get_history_size() {
+	const char *size_env = getenv("HISTSIZE");
+	if (size_env == NULL)
+		return DEFAULT_HISTORY_SIZE;
+	char *end;
+	long size = strtol(size_env, &end, 10);
+	if (*end != '\0' || size <= 0)
+		return DEFAULT_HISTORY_SIZE;
+	if (size > MAX_HISTORY_SIZE)
+		return MAX_HISTORY_SIZE;
+	return size;
+}
+
+static void ensure_ring() {
+	if (history_lines != NULL)
+		return;
+	history_size = get_history_size();
+	history_lines = calloc(history_size, sizeof(char *));
+	if (history_lines == NULL) {
+		perror("calloc");
+		exit(1);
 	}
-	int curr_line = 0;
-	while (fgets(line, 1024, fp)) {
-		if (curr_line == pos) {
-			fclose(fp);
-			return line;
-		}
-		curr_line++;
+}
+
+static void ring_push(const char *line, size_t len) {
+	ensure_ring();
+	char *entry = strndup(line, len);
+	if (entry == NULL) {
+		perror("strndup");
+		return;
 	}
 
-	fclose(fp);
-	free(path);
-	return line;
+	if (history_count == history_size) {
+		// overwrite the oldest entry
+		free(history_lines[history_start]);
+		history_lines[history_start] = entry;
+		history_start = (history_start + 1) % history_size;
+	} else {
+		history_lines[(history_start + history_count) % history_size] = entry;
+		history_count++;
+	}
+	next_seq++;
 }
 
-void lush_push_history(const char *line) {
-	char *path = get_history_path();
-	// check if the file exists and create if not
-	if (access(path, F_OK) != 0) {
-		FILE *fp = fopen(path, "w");
-		if (fp == NULL) {
-			perror("creating file");
-		} else {
-			fclose(fp);
-		}
+
+static void compact_history() {
+	size_t tmp_length = strlen(history_path) + strlen(".tmp") + 1;
+	char *tmp_path = malloc(tmp_length);
+	if (tmp_path == NULL) {
+		perror("malloc");
+		return;
 	}
+	snprintf(tmp_path, tmp_length, "%s.tmp", history_path);
 
-	FILE *fp = fopen(path, "r");
+	FILE *fp = fopen(tmp_path, "w");
 	if (fp == NULL) {
 		perror("opening file");
-		free(path);
+		free(tmp_path);
 		return;
 	}
+	int marker = fprintf(fp, "%s", HISTORY_MARKER);
+	size_t written = marker > 0 ? marker : 0;
+	for (int i = 0; i < history_count; i++) {
+		int n =
+			fprintf(fp, "%s\n", history_lines[(history_start + i) % history_size]);
+		if (n > 0)
+			written += n;
+	}
+	lush_stat_add(LUSH_STAT_HISTORY_BYTES, written);
+	if (fclose(fp) != 0 || rename(tmp_path, history_path) != 0) {
+		perror("compacting history");
+		unlink(tmp_path);
+		free(tmp_path);
+		return;
+	}
+	free(tmp_path);
+
+	// the old descriptor still points at the replaced file
+	if (history_fd != -1)
+		close(history_fd);
+	open_history_log();
+	disk_lines = history_count;
+}
+
+static void load_log(const char *data, size_t len) {
+	size_t line_start = 0;
+	for (size_t i = 0; i < len; i++) {
+		if (data[i] != '\n')
+			continue;
+		if (i > line_start)
+			ring_push(&data[line_start], i - line_start);
+		disk_lines++;
+		line_start = i + 1;
+	}
+	if (line_start < len) {
+		ring_push(&data[line_start], len - line_start);
+		disk_lines++;
+	}
+}
 
-	// Count lines
-	int line_count = 0;
-	char buffer[1024]; // Adjust buffer size as needed
-	while (fgets(buffer, sizeof(buffer), fp)) {
-		line_count++;
+static void load_legacy_log(const char *data, size_t len) {
+	// walk the newest first lines backwards so the ring still sees the
+	// oldest command first
+	size_t line_end = len;
+	for (size_t i = len; i > 0; i--) {
+		if (data[i - 1] != '\n')
+			continue;
+		if (line_end > i)
+			ring_push(&data[i], line_end - i);
+		disk_lines++;
+		line_end = i - 1;
 	}
+	if (line_end > 0) {
+		ring_push(data, line_end);
+		disk_lines++;
+	}
+}
 
-	// Allocate memory for file content
-	fseek(fp, 0, SEEK_SET);
-	char **lines = (char **)malloc(line_count * sizeof(char *));
-	if (lines == NULL) {
-		perror("malloc");
-		fclose(fp);
-		free(path);
+void lush_history_init() {
+	ensure_ring();
+	history_path = get_history_path();
+	if (history_path == NULL)
 		return;
+
+	// load the whole log in one read and keep the newest history_size
+	bool rewrite = false;
+	int fd = open(history_path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		// a new log starts out with the marker
+		rewrite = errno == ENOENT;
+	} else {
+		struct stat st;
+		char *data = NULL;
+		size_t len = 0;
+		bool complete = false;
+		if (fstat(fd, &st) == 0) {
+			if (st.st_size > 0) {
+				data = malloc(st.st_size);
+				if (data == NULL) {
+					perror("malloc");
+				}
+			}
+			while (data && len < (size_t)st.st_size) {
+				ssize_t n = read(fd, data + len, st.st_size - len);
+				if (n == -1 && errno == EINTR)
+					continue;
+				if (n <= 0)
+					break;
+				len += n;
+			}
+			complete = len == (size_t)st.st_size;
+		}
+		close(fd);
+
+		size_t marker_len = strlen(HISTORY_MARKER);
+		if (len >= marker_len && memcmp(data, HISTORY_MARKER, marker_len) == 0) {
+			load_log(data + marker_len, len - marker_len);
+		} else {
+			load_legacy_log(data, len);
+			// only convert a log that was read in full, a partial read
+			// would lose the rest of it
+			rewrite = complete;
+		}
+		free(data);
 	}
+	// only what survived loading gets indexed
+	for (unsigned int seq = first_seq(); seq != next_seq; seq++)
+		index_entry(seq);
+
+	open_history_log();
+	// rewrite the log once it holds twice the kept lines so it stays bounded,
+	// converting a legacy log is a rewrite too
+	if (rewrite || disk_lines >= history_size * 2)
+		compact_history();
+}
+
+int lush_history_count() { return history_count; }
+
+const char *lush_get_past_command(int pos) {
+	// 0 is the most recent command
+	if (pos < 0 || pos >= history_count)
+		return NULL;
+
+	return entry_at(next_seq - 1 - pos);
+}
+
+static bool entry_matches(unsigned int seq, const char *text, size_t len,
+						  bool prefix) {
+	const char *line = entry_at(seq);
+	return prefix ? strncmp(line, text, len) == 0 : strstr(line, text) != NULL;
+}
 
-	// Read lines into memory
-	int index = 0;
-	while (fgets(buffer, sizeof(buffer), fp)) {
-		lines[index] = strdup(buffer); // Allocate and copy each line
-		if (lines[index] == NULL) {
-			perror("strdup");
-			while (index > 0)
-				free(lines[--index]);
-			free(lines);
-			free(path);
-			fclose(fp);
-			return;
+static size_t posting_find(const posting_t *posting, unsigned int seq) {
+	// first slot not below seq, numbers past the ring wrap are never stored
+	size_t low = 0;
+	size_t high = posting->count;
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+		if (posting->seqs[mid] < seq)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+int lush_history_search(const char *text, int from, bool prefix, bool older) {
+	if (from < 0 || from >= history_count)
+		return -1;
+	size_t len = strlen(text);
+	unsigned int newest = next_seq - 1;
+	unsigned int start = newest - from;
+
+	if (len < 3) {
+		// too short for a trigram, these match often so a scan ends quickly
+		for (int pos = from; pos >= 0 && pos < history_count;
+			 pos += older ? 1 : -1) {
+			if (entry_matches(newest - pos, text, len, prefix))
+				return pos;
 		}
-		index++;
+		return -1;
 	}
-	fclose(fp);
 
-	// Open file for writing
-	fp = fopen(path, "w");
-	if (fp == NULL) {
-		perror("opening file");
-		for (int i = 0; i < index; i++)
-			free(lines[i]);
-		free(lines);
-		free(path);
-		return;
+	// every trigram of text has to be in a match, the rarest one has the
+	// fewest candidates to check
+	const posting_t *best = NULL;
+	for (size_t i = 0; i + 3 <= len; i++) {
+		const posting_t *posting = &trigram_index[trigram_bucket(&text[i])];
+		if (best == NULL || posting->count < best->count)
+			best = posting;
 	}
 
-	// Write the new line
-	fprintf(fp, "%s\n", line);
+	size_t slot = posting_find(best, start);
+	if (older) {
+		if (slot < best->count && best->seqs[slot] == start)
+			slot++;
+		while (slot-- > 0) {
+			unsigned int seq = best->seqs[slot];
+			if (seq < first_seq())
+				break;
+			if (entry_matches(seq, text, len, prefix))
+				return newest - seq;
+		}
+	} else {
+		for (; slot < best->count; slot++) {
+			unsigned int seq = best->seqs[slot];
+			if (seq >= first_seq() && entry_matches(seq, text, len, prefix))
+				return newest - seq;
+		}
+	}
+	return -1;
+}
 
-	// Write the last MAX_LINES lines
-	int total_lines = line_count < MAX_LINES ? line_count : MAX_LINES;
-	for (int i = 0; i < total_lines; i++) {
-		fprintf(fp, "%s", lines[i]);
-		free(lines[i]); // Free each line after writing
+static void append_log(const char *line, size_t len) {
+	// a single append keeps concurrent shells from interleaving lines
+	struct iovec iov[2] = {
+		{.iov_base = (void *)line, .iov_len = len},
+		{.iov_base = "\n", .iov_len = 1},
+	};
+	ssize_t written = writev(history_fd, iov, 2);
+	if (written == -1) {
+		perror("writing history");
+		return;
 	}
+	lush_stat_add(LUSH_STAT_HISTORY_BYTES, written);
+
+	if (++disk_lines >= history_size * 2)
+		compact_history();
+}
+
+void lush_push_history(const char *line) {
+	if (line == NULL)
+		return;
+
+	// the log is line based so trailing newlines are not stored
+	size_t len = strlen(line);
+	while (len > 0 && line[len - 1] == '\n')
+		len--;
+	if (len == 0)
+		return;
 
-	// Clean up
-	free(lines);
-	free(path);
-	fclose(fp);
+	uint64_t trace_start = lush_trace_begin();
+	ring_push(line, len);
+	index_entry(next_seq - 1);
+	if (history_fd != -1)
+		append_log(line, len);
+	lush_trace_span("history", trace_start, NULL);
 }
@@ -18,7 +18,14 @@ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
 #ifndef HISTORY_H
 #define HISTORY_H
 
-char *lush_get_past_command(int pos);
+#include <stdbool.h>
+
+void lush_history_init();
+int lush_history_count();
+const char *lush_get_past_command(int pos);
 void lush_push_history(const char* line);
+// position of the first command from pos onwards that contains text, or
+// starts with it for prefix, walking to older commands or newer ones
+int lush_history_search(const char *text, int from, bool prefix, bool older);
 
 #endif
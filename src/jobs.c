@@ -0,0 +1,425 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "jobs.h"
+#include "stats.h"
+#include "trace.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+
+typedef enum { JOB_RUNNING, JOB_STOPPED, JOB_DONE } job_state_t;
+
+typedef struct {
+	// 0 until the job is in the table
+	int id;
+	lush_job_t job;
+	bool *reaped;
+	int remaining;
+	job_state_t state;
+	// set when the state changed since the user last saw it
+	bool changed;
+	char *command;
+	// terminal modes the job had when it got stopped
+	struct termios tmodes;
+	bool has_tmodes;
+} job_entry_t;
+
+// ordered by id, the last entry is the current job
+static job_entry_t **job_table = NULL;
+static int num_jobs = 0;
+static int jobs_cap = 0;
+
+static bool interactive = false;
+static pid_t shell_pgid = 0;
+static struct termios shell_tmodes;
+static volatile sig_atomic_t children_changed = 0;
+
+static void handle_sigchld(int sig) { children_changed = 1; }
+
+void lush_jobs_init() {
+	// reaping happens before the next prompt, the handler only tells us to
+	struct sigaction sa;
+	sa.sa_handler = handle_sigchld;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGCHLD, &sa, NULL);
+
+	if (!isatty(STDIN_FILENO))
+		return;
+
+	// wait until we are in the foreground before taking the terminal
+	while (tcgetpgrp(STDIN_FILENO) != (shell_pgid = getpgrp()))
+		kill(-shell_pgid, SIGTTIN);
+
+	// stop signals are meant for the jobs, never for the shell itself
+	sa.sa_handler = SIG_IGN;
+	sa.sa_flags = 0;
+	sigaction(SIGTSTP, &sa, NULL);
+	sigaction(SIGTTIN, &sa, NULL);
+	sigaction(SIGTTOU, &sa, NULL);
+
+	// a session leader already leads its own group and gets EPERM here
+	if (setpgid(0, 0) == -1 && errno != EPERM) {
+		perror("setpgid");
+		return;
+	}
+	shell_pgid = getpgrp();
+	tcsetpgrp(STDIN_FILENO, shell_pgid);
+	tcgetattr(STDIN_FILENO, &shell_tmodes);
+	interactive = true;
+}
+
+bool lush_jobs_enabled() { return interactive; }
+
+// -- job table --
+
+static char *join_command(char ***commands) {
+	// the text shown by jobs, rebuilt from the args that were run
+	size_t len = 1;
+	for (int i = 0; commands[i]; i++) {
+		for (int j = 0; commands[i][j]; j++)
+			len += strlen(commands[i][j]) + 3;
+	}
+	char *command = malloc(len);
+	if (command == NULL) {
+		perror("malloc failed");
+		exit(1);
+	}
+	char *end = command;
+	for (int i = 0; commands[i]; i++) {
+		if (i > 0)
+			end = stpcpy(end, " | ");
+		for (int j = 0; commands[i][j]; j++) {
+			if (j > 0)
+				*end++ = ' ';
+			end = stpcpy(end, commands[i][j]);
+		}
+	}
+	*end = '\0';
+	return command;
+}
+
+static job_entry_t *new_entry(lush_job_t *job, char ***commands) {
+	job_entry_t *entry = calloc(1, sizeof(job_entry_t));
+	if (entry == NULL) {
+		perror("calloc failed");
+		exit(1);
+	}
+	entry->job = *job;
+	entry->reaped = calloc(job->num_commands, sizeof(bool));
+	if (entry->reaped == NULL) {
+		perror("calloc failed");
+		exit(1);
+	}
+	for (int i = 0; i < job->num_commands; i++) {
+		// stages that never started count as finished
+		if (job->pids[i] > 0)
+			entry->remaining++;
+		else
+			entry->reaped[i] = true;
+	}
+	entry->state = entry->remaining > 0 ? JOB_RUNNING : JOB_DONE;
+	entry->command = join_command(commands);
+	return entry;
+}
+
+static void insert_entry(job_entry_t *entry) {
+	if (num_jobs == jobs_cap) {
+		int new_cap = jobs_cap ? jobs_cap * 2 : 8;
+		job_entry_t **table =
+			realloc(job_table, new_cap * sizeof(job_entry_t *));
+		if (table == NULL) {
+			perror("realloc failed");
+			exit(1);
+		}
+		job_table = table;
+		jobs_cap = new_cap;
+	}
+	entry->id = num_jobs ? job_table[num_jobs - 1]->id + 1 : 1;
+	job_table[num_jobs++] = entry;
+}
+
+static void free_entry(job_entry_t *entry) {
+	if (entry->id > 0) {
+		for (int i = 0; i < num_jobs; i++) {
+			if (job_table[i] == entry) {
+				memmove(&job_table[i], &job_table[i + 1],
+						(num_jobs - i - 1) * sizeof(job_entry_t *));
+				num_jobs--;
+				break;
+			}
+		}
+	}
+	free(entry->reaped);
+	free(entry->command);
+	lush_free_job(&entry->job);
+	free(entry);
+}
+
+static job_entry_t *find_entry(const char *spec) {
+	if (num_jobs == 0)
+		return NULL;
+	if (spec == NULL || strcmp(spec, "%+") == 0 || strcmp(spec, "%%") == 0)
+		return job_table[num_jobs - 1];
+	if (strcmp(spec, "%-") == 0)
+		return num_jobs > 1 ? job_table[num_jobs - 2] : NULL;
+
+	if (*spec == '%')
+		spec++;
+	char *end;
+	long id = strtol(spec, &end, 10);
+	if (*spec == '\0' || *end != '\0')
+		return NULL;
+	for (int i = 0; i < num_jobs; i++) {
+		if (job_table[i]->id == id)
+			return job_table[i];
+	}
+	return NULL;
+}
+
+// -- status updates --
+
+static void update_status(job_entry_t *entry, int index, int raw_status) {
+	if (WIFSTOPPED(raw_status)) {
+		if (entry->state != JOB_STOPPED) {
+			entry->state = JOB_STOPPED;
+			entry->changed = true;
+		}
+		return;
+	}
+	if (WIFCONTINUED(raw_status)) {
+		entry->state = JOB_RUNNING;
+		return;
+	}
+
+	if (WIFEXITED(raw_status))
+		entry->job.statuses[index] = WEXITSTATUS(raw_status);
+	else if (WIFSIGNALED(raw_status))
+		entry->job.statuses[index] = 128 + WTERMSIG(raw_status);
+	entry->reaped[index] = true;
+	lush_stat_child_reaped(entry->job.pids[index]);
+	lush_trace_process_exit(entry->job.pids[index],
+							entry->job.statuses[index]);
+	if (--entry->remaining == 0) {
+		entry->state = JOB_DONE;
+		entry->changed = true;
+	}
+}
+
+static void reap_entry(job_entry_t *entry) {
+	// children are always waited for by pid so nothing that lush.spawn
+	// or lush.parallel is waiting on gets taken from them
+	for (int i = 0; i < entry->job.num_commands; i++) {
+		int raw_status;
+		while (!entry->reaped[i] &&
+			   waitpid(entry->job.pids[i], &raw_status,
+					   WNOHANG | WUNTRACED | WCONTINUED) > 0) {
+			update_status(entry, i, raw_status);
+		}
+	}
+}
+
+static void wait_entry(job_entry_t *entry) {
+	// block until every stage is done or the job gets stopped
+	int i = 0;
+	while (entry->state == JOB_RUNNING) {
+		while (entry->reaped[i])
+			i++;
+		int raw_status;
+		if (waitpid(entry->job.pids[i], &raw_status, WUNTRACED) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("waitpid");
+			entry->job.statuses[i] = -1;
+			entry->reaped[i] = true;
+			if (--entry->remaining == 0)
+				entry->state = JOB_DONE;
+			continue;
+		}
+		update_status(entry, i, raw_status);
+	}
+}
+
+static void continue_entry(job_entry_t *entry) {
+	if (entry->job.pgid > 0) {
+		kill(-entry->job.pgid, SIGCONT);
+	} else {
+		for (int i = 0; i < entry->job.num_commands; i++) {
+			if (!entry->reaped[i])
+				kill(entry->job.pids[i], SIGCONT);
+		}
+	}
+	entry->state = JOB_RUNNING;
+}
+
+static void print_entry(job_entry_t *entry) {
+	char marker = ' ';
+	if (entry == job_table[num_jobs - 1])
+		marker = '+';
+	else if (num_jobs > 1 && entry == job_table[num_jobs - 2])
+		marker = '-';
+
+	char state[32];
+	int status = entry->job.statuses[entry->job.num_commands - 1];
+	if (entry->state == JOB_RUNNING)
+		strcpy(state, "Running");
+	else if (entry->state == JOB_STOPPED)
+		strcpy(state, "Stopped");
+	else if (status == 0)
+		strcpy(state, "Done");
+	else
+		snprintf(state, sizeof(state), "Exit %d", status);
+
+	printf("[%d]%c  %-24s%s%s\n", entry->id, marker, state, entry->command,
+		   entry->state == JOB_RUNNING ? " &" : "");
+}
+
+static void reap_all() {
+	children_changed = 0;
+	for (int i = 0; i < num_jobs; i++)
+		reap_entry(job_table[i]);
+}
+
+static void print_changed(bool all) {
+	// entries are only dropped once the user has seen them finish
+	int i = 0;
+	while (i < num_jobs) {
+		job_entry_t *entry = job_table[i];
+		if (all || entry->changed) {
+			print_entry(entry);
+			entry->changed = false;
+		}
+		if (entry->state == JOB_DONE && !entry->changed)
+			free_entry(entry);
+		else
+			i++;
+	}
+}
+
+// -- foreground and background --
+
+static int foreground_entry(job_entry_t *entry, bool resume) {
+	if (interactive && entry->job.pgid > 0) {
+		tcsetpgrp(STDIN_FILENO, entry->job.pgid);
+		if (resume && entry->has_tmodes)
+			tcsetattr(STDIN_FILENO, TCSADRAIN, &entry->tmodes);
+	}
+	if (resume)
+		continue_entry(entry);
+
+	wait_entry(entry);
+
+	if (interactive) {
+		// take the terminal back along with the modes the prompt expects
+		tcsetpgrp(STDIN_FILENO, shell_pgid);
+		if (entry->state == JOB_STOPPED) {
+			tcgetattr(STDIN_FILENO, &entry->tmodes);
+			entry->has_tmodes = true;
+		}
+		tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+	}
+
+	lush_set_pipestatus(entry->job.statuses, entry->job.num_commands);
+	if (entry->state == JOB_STOPPED) {
+		if (entry->id == 0)
+			insert_entry(entry);
+		entry->changed = false;
+		printf("\n");
+		print_entry(entry);
+		return 128 + SIGTSTP;
+	}
+
+	int status = entry->job.statuses[entry->job.num_commands - 1];
+	free_entry(entry);
+	return status;
+}
+
+int lush_jobs_foreground(lush_job_t *job, char ***commands) {
+	return foreground_entry(new_entry(job, commands), false);
+}
+
+void lush_jobs_background(lush_job_t *job, char ***commands) {
+	job_entry_t *entry = new_entry(job, commands);
+	insert_entry(entry);
+	printf("[%d] %d\n", entry->id, job->pids[job->num_commands - 1]);
+}
+
+void lush_jobs_notify() {
+	if (!children_changed)
+		return;
+	reap_all();
+	print_changed(false);
+}
+
+void lush_jobs_print() {
+	reap_all();
+	print_changed(true);
+}
+
+int lush_jobs_fg(const char *spec) {
+	reap_all();
+	job_entry_t *entry = find_entry(spec);
+	if (entry == NULL)
+		return -1;
+	printf("%s\n", entry->command);
+	return foreground_entry(entry, true);
+}
+
+int lush_jobs_bg(const char *spec) {
+	reap_all();
+	job_entry_t *entry = find_entry(spec);
+	if (entry == NULL)
+		return -1;
+	if (entry->state == JOB_STOPPED)
+		continue_entry(entry);
+	printf("[%d]+ %s &\n", entry->id, entry->command);
+	return 0;
+}
+
+int lush_jobs_wait(const char *spec) {
+	reap_all();
+	if (spec != NULL) {
+		job_entry_t *entry = find_entry(spec);
+		if (entry == NULL)
+			return -1;
+		wait_entry(entry);
+		int status = entry->job.statuses[entry->job.num_commands - 1];
+		if (entry->state == JOB_DONE)
+			free_entry(entry);
+		return status;
+	}
+
+	// stopped jobs would never finish, so only running ones are waited for
+	int status = 0;
+	int i = 0;
+	while (i < num_jobs) {
+		job_entry_t *entry = job_table[i];
+		wait_entry(entry);
+		status = entry->job.statuses[entry->job.num_commands - 1];
+		if (entry->state == JOB_DONE)
+			free_entry(entry);
+		else
+			i++;
+	}
+	return status;
+}
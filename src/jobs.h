@@ -0,0 +1,42 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef JOBS_H
+#define JOBS_H
+
+#include "lush.h"
+#include <stdbool.h>
+
+// take over the terminal and start tracking jobs if stdin is a terminal
+void lush_jobs_init();
+// true when pipelines get their own process group and the terminal
+bool lush_jobs_enabled();
+// wait for a job while it owns the terminal, the job table takes over
+// the job if it gets stopped, returns the status of the last command
+int lush_jobs_foreground(lush_job_t *job, char ***commands);
+// keep track of a job that runs while the shell reads more commands
+void lush_jobs_background(lush_job_t *job, char ***commands);
+// reap finished background jobs and report them before the next prompt
+void lush_jobs_notify();
+void lush_jobs_print();
+// spec is %n, n or NULL for the current job, -1 if there is no such job
+int lush_jobs_fg(const char *spec);
+int lush_jobs_bg(const char *spec);
+// wait for one job or all of them if spec is NULL
+int lush_jobs_wait(const char *spec);
+
+#endif // JOBS_H
@@ -15,46 +15,152 @@ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
 IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
 */
 
+#define _GNU_SOURCE
+
 #include "lua_api.h"
+#include "command_cache.h"
+#include "event_loop.h"
+#include "glob.h"
+#include "hashmap.h"
 #include "history.h"
 #include "lush.h"
+#include "stats.h"
+#include "trace.h"
+#include "vars.h"
 #include <lauxlib.h>
 #include <lua.h>
 #include <lualib.h>
-#include <pwd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 // global for checking if debug_mode is toggled
 static bool debug_mode = false;
 
-// -- script execution --
-void lua_load_script(lua_State *L, const char *script, char **args) {
-	char script_path[512];
-	// check if script is in the current directory
-	if (access(script, F_OK) == 0) {
-		snprintf(script_path, sizeof(script_path), "%s", script);
-	} else {
-		const char *home_dir = getenv("HOME");
-		if (home_dir != NULL) {
-			snprintf(script_path, sizeof(script_path), "%s/.lush/scripts/%s",
-					 home_dir, script);
-
-			if (access(script_path, F_OK) != 0) {
-				// script not in either location
-				fprintf(stderr, "[C] Script not found: %s\n", script);
-				return;
-			}
-		} else {
-			// HOME not set
-			fprintf(stderr, "[C] HOME directory is not set.\n");
-			return;
+// whether lush.exec adds commands to history, scripts start without it
+static bool exec_history = false;
+
+// parsed commands from lush.exec, rolled back after each call so nested
+// calls from scripts run by lush.exec can share it
+static lush_arena_t exec_arena = {NULL, NULL};
+
+static void run_tasks();
+
+// -- script cache --
+
+typedef struct {
+	// registry reference to the compiled chunk
+	int ref;
+	struct timespec mtime;
+	off_t size;
+} script_entry_t;
+
+// compiled chunks keyed by the device and inode the script resolved to,
+// so the same file is found again no matter which path led to it
+static lush_hashmap_t script_cache;
+// scripts that were found in ~/.lush/scripts, name to full path
+static lush_hashmap_t script_dirs;
+static bool script_cache_ready = false;
+
+static void init_script_cache() {
+	if (script_cache_ready)
+		return;
+	lush_hashmap_init(&script_cache, free);
+	lush_hashmap_init(&script_dirs, free);
+	script_cache_ready = true;
+}
+
+static const char *resolve_script(const char *script, struct stat *st) {
+	// the current directory wins like before, so that is always checked
+	if (stat(script, st) == 0)
+		return script;
+
+	const char *path = lush_hashmap_get(&script_dirs, script);
+	if (path && stat(path, st) == 0)
+		return path;
+
+	const char *home_dir = lush_var_get("HOME");
+	if (home_dir == NULL) {
+		// HOME not set
+		fprintf(stderr, "[C] HOME directory is not set.\n");
+		return NULL;
+	}
+	char script_path[PATH_MAX];
+	snprintf(script_path, sizeof(script_path), "%s/.lush/scripts/%s",
+			 home_dir, script);
+	if (stat(script_path, st) != 0) {
+		// script not in either location
+		fprintf(stderr, "[C] Script not found: %s\n", script);
+		return NULL;
+	}
+
+	char *copy = strdup(script_path);
+	if (copy == NULL) {
+		perror("strdup");
+		return NULL;
+	}
+	lush_hashmap_put(&script_dirs, script, copy);
+	return lush_hashmap_get(&script_dirs, script);
+}
+
+static bool push_script(lua_State *L, const char *path, const struct stat *st) {
+	// pushes the compiled chunk, only compiling it when the file changed
+	char key[64];
+	snprintf(key, sizeof(key), "%lu:%lu", (unsigned long)st->st_dev,
+			 (unsigned long)st->st_ino);
+	script_entry_t *entry = lush_hashmap_get(&script_cache, key);
+	lush_stat_add(LUSH_STAT_SCRIPT_LOADS, 1);
+	if (entry && entry->size == st->st_size &&
+		entry->mtime.tv_sec == st->st_mtim.tv_sec &&
+		entry->mtime.tv_nsec == st->st_mtim.tv_nsec) {
+		lush_stat_add(LUSH_STAT_SCRIPT_CACHE_HITS, 1);
+		lua_rawgeti(L, LUA_REGISTRYINDEX, entry->ref);
+		return true;
+	}
+
+	if (luaL_loadfile(L, path) != LUA_OK) {
+		const char *error_msg = lua_tostring(L, -1);
+		fprintf(stderr, "[C] Error loading script: %s\n", error_msg);
+		lua_pop(L, 1); // remove error from stack
+		return false;
+	}
+
+	if (entry == NULL) {
+		entry = malloc(sizeof(script_entry_t));
+		if (entry == NULL) {
+			// still runnable, just not cached
+			perror("malloc");
+			return true;
 		}
+		lush_hashmap_put(&script_cache, key, entry);
+	} else {
+		luaL_unref(L, LUA_REGISTRYINDEX, entry->ref);
 	}
+	lua_pushvalue(L, -1);
+	entry->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	entry->mtime = st->st_mtim;
+	entry->size = st->st_size;
+	return true;
+}
+
+// -- script execution --
+int lua_load_script(lua_State *L, const char *script, char **args) {
+	init_script_cache();
+	struct stat st;
+	const char *script_path = resolve_script(script, &st);
+	if (script_path == NULL)
+		return 1;
 	// add args global if args were passed
 	if (args[0] != NULL) {
 		lua_newtable(L);
@@ -65,84 +171,1288 @@ void lua_load_script(lua_State *L, const char *script, char **args) {
 		}
 		lua_setglobal(L, "args");
 	}
+	// every script decides on its own if its commands go to history
+	bool saved_exec_history = exec_history;
+	exec_history = false;
+
 	// if we got here the file exists
-	if (luaL_loadfile(L, script_path) == LUA_OK) {
+	int top = lua_gettop(L);
+	int status = 1;
+	// loading covers the cache lookup and a compile on a miss
+	uint64_t trace_start = lush_trace_begin();
+	bool loaded = push_script(L, script_path, &st);
+	lush_trace_span("lua load", trace_start, script_path);
+	if (loaded) {
+		trace_start = lush_trace_begin();
 		if (lua_pcall(L, 0, LUA_MULTRET, 0) != LUA_OK) {
 			const char *error_msg = lua_tostring(L, -1);
 			fprintf(stderr, "[C] Error executing script: %s\n", error_msg);
-			lua_pop(L, 1); // remove error from stack
+		} else {
+			status = 0;
 		}
-	} else {
-		const char *error_msg = lua_tostring(L, -1);
-		fprintf(stderr, "[C] Error loading script: %s\n", error_msg);
-		lua_pop(L, 1); // remove error from stack
+		lush_trace_span("lua run", trace_start, script_path);
+		lua_settop(L, top);
 	}
+
+	// let coroutines started by lush.async finish before returning
+	run_tasks();
+	exec_history = saved_exec_history;
+	return status;
+}
+
+// -- library loading --
+
+typedef struct {
+	const char *global;
+	const char *lib;
+	lua_CFunction open;
+} lazy_lib_t;
+
+// opened the first time a script names them
+static const lazy_lib_t lazy_libs[] = {
+	{LUA_COLIBNAME, LUA_COLIBNAME, luaopen_coroutine},
+	{LUA_IOLIBNAME, LUA_IOLIBNAME, luaopen_io},
+	{LUA_OSLIBNAME, LUA_OSLIBNAME, luaopen_os},
+	{LUA_MATHLIBNAME, LUA_MATHLIBNAME, luaopen_math},
+	{LUA_UTF8LIBNAME, LUA_UTF8LIBNAME, luaopen_utf8},
+	{LUA_DBLIBNAME, LUA_DBLIBNAME, luaopen_debug},
+	{LUA_LOADLIBNAME, LUA_LOADLIBNAME, luaopen_package},
+	{"require", LUA_LOADLIBNAME, luaopen_package},
+	{NULL, NULL, NULL}};
+
+static int l_lazy_global(lua_State *L) {
+	// __index of the global table, only reached for globals that are unset
+	const char *name = lua_tostring(L, 2);
+	for (const lazy_lib_t *lib = lazy_libs; name && lib->global; lib++) {
+		if (strcmp(name, lib->global) == 0) {
+			luaL_requiref(L, lib->lib, lib->open, 1);
+			lua_pop(L, 1);
+			lua_rawget(L, 1);
+			return 1;
+		}
+	}
+	lua_pushnil(L);
+	return 1;
+}
+
+void lua_open_batch_libs(lua_State *L) {
+	// string is needed up front for the methods on string values
+	luaL_requiref(L, LUA_GNAME, luaopen_base, 1);
+	luaL_requiref(L, LUA_STRLIBNAME, luaopen_string, 1);
+	luaL_requiref(L, LUA_TABLIBNAME, luaopen_table, 1);
+	lua_pop(L, 3);
+
+	lua_pushglobaltable(L);
+	lua_newtable(L);
+	lua_pushcfunction(L, l_lazy_global);
+	lua_setfield(L, -2, "__index");
+	lua_setmetatable(L, -2);
+	lua_pop(L, 1);
 }
 
 // -- C funtions --
-static int execute_command(lua_State *L, const char *line) {
-	int status = 0;
-	char **commands = lush_split_pipes((char *)line);
-	char ***args = lush_split_args(commands, &status);
-	if (status == -1) {
-		fprintf(stderr, "lush: Expected end of quoted string\n");
-	} else if (lush_run(L, args, status) == 0) {
+static int execute_cmdline(lua_State *L, const lush_cmdline_t *cmdline) {
+	lush_arena_mark_t mark = lush_arena_mark(&exec_arena);
+	char ***args = lush_expand_line(&exec_arena, cmdline);
+	if (lush_run(L, args, cmdline->redirects, cmdline->num_commands,
+				 cmdline->background) == 0) {
 		exit(1);
 	}
+	lush_arena_release(&exec_arena, mark);
+	return cmdline->num_commands;
+}
+
+static bool wants_history(lua_State *L, int opts_index) {
+	// an options table such as {history = true} overrides the default
+	bool record = exec_history;
+	if (lua_istable(L, opts_index)) {
+		if (lua_getfield(L, opts_index, "history") != LUA_TNIL)
+			record = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+	}
+	return record;
+}
 
-	for (int i = 0; args[i]; i++) {
-		free(args[i]);
+static int execute_command(lua_State *L, const char *line, bool history) {
+	int status = -1;
+	// scripts tend to run the same lines over and over, so reuse the parse
+	lush_cached_line_t *entry = lush_cache_acquire(line);
+	if (entry == NULL) {
+		fprintf(stderr, "lush: Expected end of quoted string\n");
+	} else {
+		status = execute_cmdline(L, &entry->cmdline);
+		lush_cache_release(entry);
 	}
-	lush_push_history(line);
-	free(args);
-	free(commands);
+
+	if (history)
+		lush_push_history(line);
 	return status;
 }
 
-static char *get_expanded_path(const char *check_item) {
-	uid_t uid = getuid();
-	struct passwd *pw = getpwuid(uid);
-	if (!pw) {
-		perror("retrieve home dir");
-		return NULL;
+// -- compiled commands --
+
+#define COMMAND_METATABLE "lush.command"
+
+// handle returned by lush.compile, owns its parsed line
+typedef struct {
+	lush_arena_t arena;
+	lush_cmdline_t cmdline;
+	char *text;
+} compiled_command_t;
+
+static void debug_print_result(const char *command, bool rc) {
+	if (debug_mode) {
+		if (rc)
+			printf("Executed: %s, success\n", command);
+		else
+			printf("Executed: %s, failed\n", command);
 	}
+}
 
-	if (check_item == NULL) {
-		// passed nothing
-		return NULL;
+static int l_command_run(lua_State *L) {
+	compiled_command_t *compiled = luaL_checkudata(L, 1, COMMAND_METATABLE);
+	execute_cmdline(L, &compiled->cmdline);
+	if (wants_history(L, 2))
+		lush_push_history(compiled->text);
+
+	debug_print_result(compiled->text, true);
+	lua_pushboolean(L, true);
+	return 1;
+}
+
+static int l_command_gc(lua_State *L) {
+	compiled_command_t *compiled = luaL_checkudata(L, 1, COMMAND_METATABLE);
+	lush_arena_free(&compiled->arena);
+	return 0;
+}
+
+static void register_command_metatable(lua_State *L) {
+	luaL_newmetatable(L, COMMAND_METATABLE);
+	lua_newtable(L);
+	lua_pushcfunction(L, l_command_run);
+	lua_setfield(L, -2, "run");
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, l_command_run);
+	lua_setfield(L, -2, "__call");
+	lua_pushcfunction(L, l_command_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+}
+
+// -- captured output --
+
+#define CAPTURE_CHUNK 65536
+#define LINES_METATABLE "lush.lines"
+
+static int start_captured(const char *line, lush_job_t *job, int *out_fd,
+						  int *err_fd) {
+	// stdout if out_fd is given and stderr if err_fd is given are piped
+	// back to the caller, anything else goes to the terminal
+	lush_cached_line_t *entry = lush_cache_acquire(line);
+	if (entry == NULL) {
+		fprintf(stderr, "lush: Expected end of quoted string\n");
+		return -1;
 	}
 
-	char path[PATH_MAX];
-	char *tilda = strchr(check_item, '~');
-	if (tilda) {
-		strcpy(path, pw->pw_dir);
-		strcat(path, tilda + 1);
+	lush_arena_mark_t mark = lush_arena_mark(&exec_arena);
+	char ***args = lush_expand_line(&exec_arena, &entry->cmdline);
+	int out_pipe[2] = {-1, -1};
+	int err_pipe[2] = {-1, -1};
+	int rc = -1;
+
+	if (args[0] == NULL || args[0][0] == NULL || args[0][0][0] == '\0') {
+		// no command given
+	} else if ((out_fd && pipe2(out_pipe, O_CLOEXEC) == -1) ||
+			   (err_fd && pipe2(err_pipe, O_CLOEXEC) == -1)) {
+		perror("pipe");
 	} else {
-		strcpy(path, check_item);
+		rc = lush_start_pipeline(job, args, entry->cmdline.redirects,
+								 entry->cmdline.num_commands,
+								 STDIN_FILENO,
+								 out_fd ? out_pipe[1] : STDOUT_FILENO,
+								 err_fd ? err_pipe[1] : STDERR_FILENO, false);
 	}
-	char *exp_path = realpath(path, NULL);
-	// if the path doesnt exist
-	if (!exp_path) {
-		return NULL;
+
+	// only the children keep the write ends
+	if (out_pipe[1] != -1)
+		close(out_pipe[1]);
+	if (err_pipe[1] != -1)
+		close(err_pipe[1]);
+	if (rc == -1) {
+		if (out_pipe[0] != -1)
+			close(out_pipe[0]);
+		if (err_pipe[0] != -1)
+			close(err_pipe[0]);
+	} else {
+		if (out_fd)
+			*out_fd = out_pipe[0];
+		if (err_fd)
+			*err_fd = err_pipe[0];
+	}
+
+	lush_arena_release(&exec_arena, mark);
+	lush_cache_release(entry);
+	return rc;
+}
+
+static bool read_chunk(int fd, char *dest, size_t size, ssize_t *n) {
+	// false once the pipe is at EOF or broken
+	do {
+		*n = read(fd, dest, size);
+	} while (*n == -1 && errno == EINTR);
+	return *n > 0;
+}
+
+static int l_capture(lua_State *L) {
+	const char *command = luaL_checkstring(L, 1);
+	lush_job_t job;
+	int out_fd, err_fd;
+	if (start_captured(command, &job, &out_fd, &err_fd) == -1) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	// stdout goes straight into a Lua buffer, stderr is usually small and
+	// is collected on the side since only one luaL_Buffer can be open
+	luaL_Buffer out;
+	luaL_buffinit(L, &out);
+	char *err_data = NULL;
+	size_t err_len = 0;
+	size_t err_cap = 0;
+
+	struct pollfd fds[2] = {{out_fd, POLLIN, 0}, {err_fd, POLLIN, 0}};
+	int open_fds = 2;
+	while (open_fds > 0) {
+		if (poll(fds, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+
+		ssize_t n;
+		if (fds[0].revents) {
+			char *dest = luaL_prepbuffsize(&out, CAPTURE_CHUNK);
+			if (read_chunk(out_fd, dest, CAPTURE_CHUNK, &n)) {
+				luaL_addsize(&out, n);
+			} else {
+				fds[0].fd = -1;
+				open_fds--;
+			}
+		}
+		if (fds[1].revents) {
+			if (err_cap - err_len < CAPTURE_CHUNK) {
+				size_t new_cap = err_cap ? err_cap * 2 : CAPTURE_CHUNK;
+				char *data = realloc(err_data, new_cap);
+				if (data == NULL) {
+					perror("realloc");
+					break;
+				}
+				err_data = data;
+				err_cap = new_cap;
+			}
+			if (read_chunk(err_fd, err_data + err_len, err_cap - err_len,
+						   &n)) {
+				err_len += n;
+			} else {
+				fds[1].fd = -1;
+				open_fds--;
+			}
+		}
+	}
+	close(out_fd);
+	close(err_fd);
+
+	lush_wait_pipeline(&job);
+	int status = job.statuses[job.num_commands - 1];
+	lush_free_job(&job);
+
+	luaL_pushresult(&out);
+	lua_pushlstring(L, err_data ? err_data : "", err_len);
+	free(err_data);
+	lua_pushinteger(L, status);
+	return 3;
+}
+
+// children whose handle was dropped before they exited, reaped without
+// blocking so a collected handle never stalls the shell
+static pid_t *orphans = NULL;
+static size_t num_orphans = 0;
+static size_t orphans_cap = 0;
+
+void lua_reap_orphans() {
+	size_t kept = 0;
+	for (size_t i = 0; i < num_orphans; i++) {
+		int status;
+		if (lush_try_wait(orphans[i], &status) == 0)
+			orphans[kept++] = orphans[i];
+	}
+	num_orphans = kept;
+}
+
+static void adopt_orphan(pid_t pid) {
+	int status;
+	lua_reap_orphans();
+	if (lush_try_wait(pid, &status) != 0)
+		return;
+	if (num_orphans == orphans_cap) {
+		size_t cap = orphans_cap ? orphans_cap * 2 : 16;
+		pid_t *grown = realloc(orphans, cap * sizeof(pid_t));
+		if (grown == NULL) {
+			// without room to remember it the child is not left a zombie
+			perror("realloc");
+			kill(pid, SIGKILL);
+			waitpid(pid, NULL, 0);
+			lush_stat_child_reaped(pid);
+			lush_trace_process_exit(pid, -1);
+			return;
+		}
+		orphans = grown;
+		orphans_cap = cap;
+	}
+	orphans[num_orphans++] = pid;
+}
+
+// state of a lush.lines iterator
+typedef struct {
+	lush_job_t job;
+	bool running;
+	// -1 once the pipe reached EOF
+	int fd;
+	char *buffer;
+	size_t start;
+	size_t scanned;
+	size_t len;
+	size_t cap;
+} line_reader_t;
+
+static void finish_reader(line_reader_t *reader, bool wait) {
+	// closing first makes a child that is still writing exit on SIGPIPE,
+	// a reader that was dropped early leaves its pipeline to be reaped
+	// once it exits
+	if (reader->fd != -1) {
+		close(reader->fd);
+		reader->fd = -1;
+	}
+	if (reader->running && wait) {
+		lush_wait_pipeline(&reader->job);
+	} else if (reader->running) {
+		for (int i = 0; i < reader->job.num_commands; i++) {
+			if (reader->job.pids[i] > 0)
+				adopt_orphan(reader->job.pids[i]);
+		}
+	}
+	if (reader->running) {
+		lush_free_job(&reader->job);
+		reader->running = false;
+	}
+	free(reader->buffer);
+	reader->buffer = NULL;
+}
+
+static int l_lines_next(lua_State *L) {
+	line_reader_t *reader =
+		luaL_checkudata(L, lua_upvalueindex(1), LINES_METATABLE);
+
+	while (reader->fd != -1) {
+		char *newline = memchr(reader->buffer + reader->scanned, '\n',
+							   reader->len - reader->scanned);
+		if (newline) {
+			size_t end = newline - reader->buffer;
+			lua_pushlstring(L, reader->buffer + reader->start,
+							end - reader->start);
+			reader->start = end + 1;
+			reader->scanned = reader->start;
+			return 1;
+		}
+
+		// only the unfinished line is kept, memory stays bounded by it
+		memmove(reader->buffer, reader->buffer + reader->start,
+				reader->len - reader->start);
+		reader->len -= reader->start;
+		reader->scanned = reader->len;
+		reader->start = 0;
+		if (reader->cap - reader->len < CAPTURE_CHUNK) {
+			char *buffer = realloc(reader->buffer, reader->cap * 2);
+			if (buffer == NULL) {
+				finish_reader(reader, false);
+				return luaL_error(L, "lush.lines: out of memory");
+			}
+			reader->buffer = buffer;
+			reader->cap *= 2;
+		}
+
+		ssize_t n;
+		if (read_chunk(reader->fd, reader->buffer + reader->len,
+					   reader->cap - reader->len, &n)) {
+			reader->len += n;
+		} else {
+			close(reader->fd);
+			reader->fd = -1;
+		}
+	}
+
+	// the last line may not end in a newline
+	if (reader->buffer && reader->start < reader->len) {
+		lua_pushlstring(L, reader->buffer + reader->start,
+						reader->len - reader->start);
+		reader->start = reader->len;
+		return 1;
+	}
+
+	finish_reader(reader, true);
+	lua_pushnil(L);
+	return 1;
+}
+
+static int l_lines_close(lua_State *L) {
+	finish_reader(luaL_checkudata(L, 1, LINES_METATABLE), false);
+	return 0;
+}
+
+static int l_lines(lua_State *L) {
+	const char *command = luaL_checkstring(L, 1);
+	line_reader_t *reader = lua_newuserdatauv(L, sizeof(line_reader_t), 0);
+	reader->running = false;
+	reader->fd = -1;
+	reader->buffer = NULL;
+	reader->start = 0;
+	reader->scanned = 0;
+	reader->len = 0;
+	reader->cap = 0;
+	luaL_setmetatable(L, LINES_METATABLE);
+
+	reader->buffer = malloc(CAPTURE_CHUNK * 2);
+	if (reader->buffer == NULL) {
+		return luaL_error(L, "lush.lines: out of memory");
+	}
+	reader->cap = CAPTURE_CHUNK * 2;
+	if (start_captured(command, &reader->job, &reader->fd, NULL) == -1) {
+		reader->fd = -1;
+	} else {
+		reader->running = true;
+	}
+
+	// iterator, state, control and the reader as the to be closed value so
+	// breaking out of the loop stops the pipeline right away
+	lua_pushvalue(L, -1);
+	lua_pushcclosure(L, l_lines_next, 1);
+	lua_pushnil(L);
+	lua_pushnil(L);
+	lua_pushvalue(L, -4);
+	return 4;
+}
+
+static void register_lines_metatable(lua_State *L) {
+	luaL_newmetatable(L, LINES_METATABLE);
+	lua_pushcfunction(L, l_lines_close);
+	lua_setfield(L, -2, "__close");
+	lua_pushcfunction(L, l_lines_close);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+}
+
+// -- parallel execution --
+
+// growable buffer for output collected outside of Lua
+typedef struct {
+	char *data;
+	size_t len;
+	size_t cap;
+} output_t;
+
+// one command of lush.parallel that is currently running
+typedef struct {
+	int index;
+	lush_job_t job;
+	// pidfd for each process or -1 if the kernel has no pidfd_open
+	int *pidfds;
+	bool *reaped;
+	int remaining;
+	// -1 once closed, stdout then stderr
+	int fds[2];
+	output_t output[2];
+	struct timespec start;
+} parallel_slot_t;
+
+static bool read_into(int fd, output_t *output) {
+	if (output->cap - output->len < CAPTURE_CHUNK) {
+		size_t new_cap = output->cap ? output->cap * 2 : CAPTURE_CHUNK;
+		char *data = realloc(output->data, new_cap);
+		if (data == NULL) {
+			perror("realloc");
+			return false;
+		}
+		output->data = data;
+		output->cap = new_cap;
+	}
+	ssize_t n;
+	if (!read_chunk(fd, output->data + output->len, output->cap - output->len,
+					&n))
+		return false;
+	output->len += n;
+	return true;
+}
+
+static bool start_slot(parallel_slot_t *slot, const char *line, int index,
+					   bool capture) {
+	memset(slot, 0, sizeof(parallel_slot_t));
+	slot->index = index;
+	slot->fds[0] = -1;
+	slot->fds[1] = -1;
+	clock_gettime(CLOCK_MONOTONIC, &slot->start);
+	if (start_captured(line, &slot->job, capture ? &slot->fds[0] : NULL,
+					   capture ? &slot->fds[1] : NULL) == -1)
+		return false;
+
+	int num_commands = slot->job.num_commands;
+	slot->pidfds = malloc(num_commands * sizeof(int));
+	slot->reaped = calloc(num_commands, sizeof(bool));
+	if (!slot->pidfds || !slot->reaped) {
+		perror("malloc");
+		exit(1);
+	}
+	for (int i = 0; i < num_commands; i++) {
+		pid_t pid = slot->job.pids[i];
+		slot->pidfds[i] = pid > 0 ? lush_pidfd_open(pid) : -1;
+		// stages that never started are already done
+		slot->reaped[i] = pid <= 0;
+		if (pid > 0)
+			slot->remaining++;
+	}
+	return true;
+}
+
+static bool update_slot(parallel_slot_t *slot) {
+	// drain pipes and reap exited processes, true once everything is done
+	for (int i = 0; i < 2; i++) {
+		if (slot->fds[i] == -1)
+			continue;
+		struct pollfd pfd = {slot->fds[i], POLLIN, 0};
+		// one read per wakeup so a chatty command cannot starve the rest
+		if (poll(&pfd, 1, 0) > 0 && !read_into(slot->fds[i], &slot->output[i])) {
+			close(slot->fds[i]);
+			slot->fds[i] = -1;
+		}
+	}
+
+	for (int i = 0; i < slot->job.num_commands; i++) {
+		if (slot->reaped[i])
+			continue;
+		if (lush_try_wait(slot->job.pids[i], &slot->job.statuses[i]) != 0) {
+			slot->reaped[i] = true;
+			slot->remaining--;
+			if (slot->pidfds[i] != -1) {
+				close(slot->pidfds[i]);
+				slot->pidfds[i] = -1;
+			}
+		}
+	}
+
+	return slot->remaining == 0 && slot->fds[0] == -1 && slot->fds[1] == -1;
+}
+
+static void push_slot_result(lua_State *L, parallel_slot_t *slot,
+							 int results_index, bool capture) {
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double elapsed = (end.tv_sec - slot->start.tv_sec) +
+					 (end.tv_nsec - slot->start.tv_nsec) / 1e9;
+
+	lua_createtable(L, 0, 4);
+	lua_pushinteger(L, slot->job.statuses[slot->job.num_commands - 1]);
+	lua_setfield(L, -2, "status");
+	lua_pushnumber(L, elapsed);
+	lua_setfield(L, -2, "time");
+	if (capture) {
+		lua_pushlstring(L, slot->output[0].data ? slot->output[0].data : "",
+						slot->output[0].len);
+		lua_setfield(L, -2, "stdout");
+		lua_pushlstring(L, slot->output[1].data ? slot->output[1].data : "",
+						slot->output[1].len);
+		lua_setfield(L, -2, "stderr");
+	}
+	lua_rawseti(L, results_index, slot->index + 1);
+
+	free(slot->output[0].data);
+	free(slot->output[1].data);
+	free(slot->pidfds);
+	free(slot->reaped);
+	lush_free_job(&slot->job);
+}
+
+static void push_failed_result(lua_State *L, int results_index, int index) {
+	lua_createtable(L, 0, 2);
+	lua_pushinteger(L, -1);
+	lua_setfield(L, -2, "status");
+	lua_pushnumber(L, 0.0);
+	lua_setfield(L, -2, "time");
+	lua_rawseti(L, results_index, index + 1);
+}
+
+static int l_parallel(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	int num_cmds = luaL_len(L, 1);
+	long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	bool capture = false;
+	if (lua_istable(L, 2)) {
+		if (lua_getfield(L, 2, "jobs") != LUA_TNIL)
+			jobs = luaL_checkinteger(L, -1);
+		lua_pop(L, 1);
+		lua_getfield(L, 2, "capture");
+		capture = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+	}
+	if (jobs < 1)
+		jobs = 1;
+	if (jobs > num_cmds)
+		jobs = num_cmds > 0 ? num_cmds : 1;
+
+	lua_createtable(L, num_cmds, 0);
+	int results_index = lua_gettop(L);
+
+	parallel_slot_t *slots = calloc(jobs, sizeof(parallel_slot_t));
+	bool *busy = calloc(jobs, sizeof(bool));
+	// a pidfd per process plus two pipes per pipeline
+	struct pollfd *fds = NULL;
+	size_t fds_cap = 0;
+	if (!slots || !busy) {
+		perror("calloc failed");
+		exit(1);
+	}
+
+	int next = 0;
+	int running = 0;
+	while (next < num_cmds || running > 0) {
+		// keep up to jobs pipelines in flight
+		for (int i = 0; i < jobs && next < num_cmds; i++) {
+			if (busy[i])
+				continue;
+			lua_geti(L, 1, next + 1);
+			const char *line = lua_tostring(L, -1);
+			if (line && start_slot(&slots[i], line, next, capture)) {
+				busy[i] = true;
+				running++;
+			} else {
+				push_failed_result(L, results_index, next);
+			}
+			lua_pop(L, 1);
+			next++;
+		}
+
+		// wait for any process to exit or any pipe to have data, without
+		// pidfds the children are polled every few milliseconds instead
+		size_t num_fds = 0;
+		bool fallback = false;
+		for (int i = 0; i < jobs; i++) {
+			if (!busy[i])
+				continue;
+			size_t needed = num_fds + slots[i].job.num_commands + 2;
+			if (needed > fds_cap) {
+				fds_cap = needed * 2;
+				fds = realloc(fds, fds_cap * sizeof(struct pollfd));
+				if (fds == NULL) {
+					perror("realloc failed");
+					exit(1);
+				}
+			}
+			for (int j = 0; j < slots[i].job.num_commands; j++) {
+				if (slots[i].reaped[j])
+					continue;
+				if (slots[i].pidfds[j] == -1)
+					fallback = true;
+				else
+					fds[num_fds++] =
+						(struct pollfd){slots[i].pidfds[j], POLLIN, 0};
+			}
+			for (int j = 0; j < 2; j++) {
+				if (slots[i].fds[j] != -1)
+					fds[num_fds++] = (struct pollfd){slots[i].fds[j], POLLIN, 0};
+			}
+		}
+		if (running > 0 &&
+			poll(fds, num_fds, fallback ? 10 : -1) == -1 && errno != EINTR) {
+			perror("poll");
+		}
+
+		for (int i = 0; i < jobs; i++) {
+			if (busy[i] && update_slot(&slots[i])) {
+				push_slot_result(L, &slots[i], results_index, capture);
+				busy[i] = false;
+				running--;
+			}
+		}
+	}
+
+	free(fds);
+	free(busy);
+	free(slots);
+	return 1;
+}
+
+// -- async processes --
+
+#define PROCESS_METATABLE "lush.process"
+// registry table of the coroutines started by lush.async
+#define TASKS_KEY "lush.tasks"
+
+typedef struct {
+	lush_job_t job;
+	bool running;
+	lush_watch_t **pid_watches;
+	int remaining;
+	int status;
+	// -1 when stdout is not piped or reached EOF
+	int out_fd;
+	lush_watch_t *out_watch;
+	output_t unread;
+	// coroutines suspended in wait and read, NULL if nobody waits
+	lua_State *wait_task;
+	lua_State *read_task;
+	// callers blocking in the loop outside of a task
+	int blocked_waits;
+	int blocked_reads;
+} process_t;
+
+static int num_tasks = 0;
+
+static bool in_task(lua_State *L) {
+	// only coroutines from lush.async are resumed by the loop, any other
+	// caller blocks on the loop instead of yielding to someone unaware
+	if (!lua_isyieldable(L))
+		return false;
+	lua_getfield(L, LUA_REGISTRYINDEX, TASKS_KEY);
+	lua_pushthread(L);
+	bool managed = lua_rawget(L, -2) != LUA_TNIL;
+	lua_pop(L, 2);
+	return managed;
+}
+
+static void resume_task(lua_State *task, int nargs) {
+	int nres;
+	int rc = lua_resume(task, NULL, nargs, &nres);
+	if (rc == LUA_YIELD) {
+		lua_pop(task, nres);
+		return;
 	}
+	if (rc != LUA_OK)
+		fprintf(stderr, "[C] Error in async task: %s\n", lua_tostring(task, -1));
+	lua_settop(task, 0);
 
-	return exp_path;
+	// finished, the registry entry was the only thing keeping it alive
+	lua_getfield(task, LUA_REGISTRYINDEX, TASKS_KEY);
+	lua_pushthread(task);
+	lua_pushnil(task);
+	lua_rawset(task, -3);
+	lua_pop(task, 1);
+	num_tasks--;
+}
+
+static void process_event(void *data, uint32_t events);
+static void process_read_event(void *data, uint32_t events);
+
+static void update_read_watch(process_t *process) {
+	// stdout is only drained while someone wants it, waiting counts too
+	// so a child never blocks on a full pipe while we wait for its exit
+	bool wanted = process->read_task || process->blocked_reads ||
+				  process->wait_task || process->blocked_waits;
+	if (wanted && process->out_fd != -1 && process->out_watch == NULL) {
+		process->out_watch =
+			lush_loop_watch_fd(process->out_fd, process_read_event, process);
+	} else if (!wanted && process->out_watch) {
+		lush_loop_unwatch(process->out_watch);
+		process->out_watch = NULL;
+	}
+}
+
+static bool push_unread(lua_State *L, process_t *process) {
+	// the next chunk for read, false while there is nothing yet
+	if (process->unread.len > 0) {
+		lua_pushlstring(L, process->unread.data, process->unread.len);
+		process->unread.len = 0;
+		return true;
+	}
+	if (process->out_fd == -1) {
+		lua_pushnil(L);
+		return true;
+	}
+	return false;
+}
+
+static void close_output(process_t *process) {
+	if (process->out_watch) {
+		lush_loop_unwatch(process->out_watch);
+		process->out_watch = NULL;
+	}
+	if (process->out_fd != -1) {
+		close(process->out_fd);
+		process->out_fd = -1;
+	}
+}
+
+static void process_read_event(void *data, uint32_t events) {
+	process_t *process = data;
+	if (!read_into(process->out_fd, &process->unread))
+		close_output(process);
+
+	lua_State *task = process->read_task;
+	if (task && push_unread(task, process)) {
+		process->read_task = NULL;
+		update_read_watch(process);
+		resume_task(task, 1);
+	}
+}
+
+static void process_event(void *data, uint32_t events) {
+	process_t *process = data;
+	for (int i = 0; i < process->job.num_commands; i++) {
+		if (process->pid_watches[i] == NULL)
+			continue;
+		if (lush_try_wait(process->job.pids[i], &process->job.statuses[i]) !=
+			0) {
+			lush_loop_unwatch(process->pid_watches[i]);
+			process->pid_watches[i] = NULL;
+			process->remaining--;
+		}
+	}
+	if (process->remaining > 0)
+		return;
+
+	process->running = false;
+	process->status = process->job.statuses[process->job.num_commands - 1];
+	lua_State *task = process->wait_task;
+	if (task) {
+		process->wait_task = NULL;
+		update_read_watch(process);
+		lua_pushinteger(task, process->status);
+		resume_task(task, 1);
+	}
+}
+
+static int l_process_wait(lua_State *L) {
+	process_t *process = luaL_checkudata(L, 1, PROCESS_METATABLE);
+	if (process->running && in_task(L)) {
+		if (process->wait_task)
+			return luaL_error(L, "process is already being waited on");
+		process->wait_task = L;
+		update_read_watch(process);
+		return lua_yield(L, 0);
+	}
+
+	process->blocked_waits++;
+	update_read_watch(process);
+	while (process->running)
+		lush_loop_run_once(-1);
+	process->blocked_waits--;
+	update_read_watch(process);
+	lua_pushinteger(L, process->status);
+	return 1;
+}
+
+static int l_process_read(lua_State *L) {
+	process_t *process = luaL_checkudata(L, 1, PROCESS_METATABLE);
+	if (push_unread(L, process))
+		return 1;
+	if (in_task(L)) {
+		if (process->read_task)
+			return luaL_error(L, "process is already being read from");
+		process->read_task = L;
+		update_read_watch(process);
+		return lua_yield(L, 0);
+	}
+
+	process->blocked_reads++;
+	update_read_watch(process);
+	while (!push_unread(L, process))
+		lush_loop_run_once(-1);
+	process->blocked_reads--;
+	update_read_watch(process);
+	return 1;
+}
+
+static int l_process_kill(lua_State *L) {
+	process_t *process = luaL_checkudata(L, 1, PROCESS_METATABLE);
+	int sig = luaL_optinteger(L, 2, SIGTERM);
+	for (int i = 0; i < process->job.num_commands; i++) {
+		if (process->pid_watches[i])
+			kill(process->job.pids[i], sig);
+	}
+	return 0;
+}
+
+static int l_process_gc(lua_State *L) {
+	process_t *process = luaL_checkudata(L, 1, PROCESS_METATABLE);
+	close_output(process);
+	// nobody can wait on it anymore, it is reaped without blocking once it
+	// exits so it does not stay a zombie
+	for (int i = 0; i < process->job.num_commands; i++) {
+		if (process->pid_watches[i]) {
+			lush_loop_unwatch(process->pid_watches[i]);
+			adopt_orphan(process->job.pids[i]);
+		}
+	}
+	free(process->pid_watches);
+	free(process->unread.data);
+	lush_free_job(&process->job);
+	return 0;
+}
+
+static int l_spawn(lua_State *L) {
+	const char *command = luaL_checkstring(L, 1);
+	bool capture = false;
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "capture");
+		capture = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+	}
+
+	process_t *process = lua_newuserdatauv(L, sizeof(process_t), 0);
+	memset(process, 0, sizeof(process_t));
+	process->out_fd = -1;
+	if (start_captured(command, &process->job,
+					   capture ? &process->out_fd : NULL, NULL) == -1) {
+		lua_pushnil(L);
+		return 1;
+	}
+	// the metatable only goes on once there is a job for __gc to free
+	luaL_setmetatable(L, PROCESS_METATABLE);
+
+	process->running = true;
+	process->status = -1;
+	process->pid_watches =
+		calloc(process->job.num_commands, sizeof(lush_watch_t *));
+	if (process->pid_watches == NULL) {
+		perror("calloc failed");
+		exit(1);
+	}
+	for (int i = 0; i < process->job.num_commands; i++) {
+		if (process->job.pids[i] <= 0)
+			continue;
+		process->pid_watches[i] =
+			lush_loop_watch_pid(process->job.pids[i], process_event, process);
+		if (process->pid_watches[i] == NULL) {
+			// no way to watch it, so it is waited for right here
+			waitpid(process->job.pids[i], NULL, 0);
+			lush_stat_child_reaped(process->job.pids[i]);
+			lush_trace_process_exit(process->job.pids[i], -1);
+			process->job.statuses[i] = -1;
+			continue;
+		}
+		process->remaining++;
+	}
+	if (process->remaining == 0)
+		process_event(process, 0);
+	return 1;
+}
+
+static int l_async(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+	int nargs = lua_gettop(L) - 1;
+	lua_State *task = lua_newthread(L);
+
+	// keep the coroutine alive until it returns
+	lua_getfield(L, LUA_REGISTRYINDEX, TASKS_KEY);
+	lua_pushvalue(L, -2);
+	lua_pushboolean(L, true);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+	num_tasks++;
+
+	lua_rotate(L, 1, 1);
+	lua_xmove(L, task, nargs + 1);
+	resume_task(task, nargs);
+	return 1;
+}
+
+static void run_tasks() {
+	while (num_tasks > 0 && lush_loop_count() > 0)
+		lush_loop_run_once(-1);
+}
+
+static int l_run(lua_State *L) {
+	run_tasks();
+	return 0;
+}
+
+static void register_process_metatable(lua_State *L) {
+	luaL_newmetatable(L, PROCESS_METATABLE);
+	lua_newtable(L);
+	lua_pushcfunction(L, l_process_wait);
+	lua_setfield(L, -2, "wait");
+	lua_pushcfunction(L, l_process_read);
+	lua_setfield(L, -2, "read");
+	lua_pushcfunction(L, l_process_kill);
+	lua_setfield(L, -2, "kill");
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, l_process_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
+	lua_newtable(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, TASKS_KEY);
+}
+
+// -- pipeline filters --
+
+#define FILTERS_KEY "lush.filters"
+
+// thread used to look filters up while a pipeline is being started, the
+// thread running the script may be suspended in a coroutine at that point
+static lua_State *filter_state = NULL;
+
+static bool push_filter(lua_State *L, const char *name) {
+	// registered filters first, then plain global functions
+	lua_getfield(L, LUA_REGISTRYINDEX, FILTERS_KEY);
+	if (lua_getfield(L, -1, name) == LUA_TFUNCTION) {
+		lua_remove(L, -2);
+		return true;
+	}
+	lua_pop(L, 2);
+	if (lua_getglobal(L, name) == LUA_TFUNCTION)
+		return true;
+	lua_pop(L, 1);
+	return false;
+}
+
+static bool append_output(output_t *output, const char *data, size_t len) {
+	if (output->cap - output->len < len) {
+		size_t new_cap = output->cap ? output->cap : CAPTURE_CHUNK;
+		while (new_cap - output->len < len)
+			new_cap *= 2;
+		char *buffer = realloc(output->data, new_cap);
+		if (buffer == NULL) {
+			perror("realloc");
+			return false;
+		}
+		output->data = buffer;
+		output->cap = new_cap;
+	}
+	memcpy(output->data + output->len, data, len);
+	output->len += len;
+	return true;
+}
+
+static bool flush_output(int fd, output_t *output) {
+	size_t written = 0;
+	while (written < output->len) {
+		ssize_t n = write(fd, output->data + written, output->len - written);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		written += n;
+	}
+	output->len = 0;
+	return true;
+}
+
+static bool filter_line(lua_State *L, char **args, const char *line,
+						size_t len, output_t *output) {
+	// the filter is at index 1, it gets the line and any args of the stage
+	// and whatever it returns is written out as a line, nil drops it
+	lua_pushvalue(L, 1);
+	lua_pushlstring(L, line, len);
+	int nargs = 1;
+	for (int i = 1; args[i]; i++, nargs++)
+		lua_pushstring(L, args[i]);
+	if (lua_pcall(L, nargs, 1, 0) != LUA_OK) {
+		fprintf(stderr, "lush: %s: %s\n", args[0], lua_tostring(L, -1));
+		return false;
+	}
+
+	size_t result_len;
+	const char *result = lua_tolstring(L, -1, &result_len);
+	bool ok = true;
+	if (result) {
+		ok = append_output(output, result, result_len) &&
+			 append_output(output, "\n", 1);
+		// written in large blocks rather than once per line
+		if (ok && output->len >= CAPTURE_CHUNK)
+			ok = flush_output(STDOUT_FILENO, output);
+	}
+	lua_pop(L, 1);
+	return ok;
+}
+
+static int run_filter(lua_State *L, char **args) {
+	output_t input = {NULL, 0, 0};
+	output_t output = {NULL, 0, 0};
+	size_t start = 0;
+	bool ok = true;
+
+	while (ok) {
+		// only the unfinished line is kept between reads
+		if (start > 0) {
+			memmove(input.data, input.data + start, input.len - start);
+			input.len -= start;
+			start = 0;
+		}
+		if (!read_into(STDIN_FILENO, &input))
+			break;
+
+		char *newline;
+		while (ok && (newline = memchr(input.data + start, '\n',
+									   input.len - start)) != NULL) {
+			size_t end = newline - input.data;
+			ok = filter_line(L, args, input.data + start, end - start, &output);
+			start = end + 1;
+		}
+	}
+
+	// the last line may not end in a newline
+	if (ok && start < input.len)
+		ok = filter_line(L, args, input.data + start, input.len - start,
+						 &output);
+	if (ok)
+		ok = flush_output(STDOUT_FILENO, &output);
+	fflush(stdout);
+	free(input.data);
+	free(output.data);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void close_inherited_fds() {
+	// the filter never execs so O_CLOEXEC does not apply, keeping a reader
+	// of its own output pipe would stop it from ever seeing EPIPE
+	if (close_range(3, ~0U, 0) == 0)
+		return;
+	long max_fd = sysconf(_SC_OPEN_MAX);
+	if (max_fd < 0)
+		max_fd = 1024;
+	for (long fd = 3; fd < max_fd; fd++)
+		close(fd);
+}
+
+pid_t lua_spawn_filter(char **args, int input_fd, int output_fd, int error_fd,
+					   pid_t pgid) {
+	const char *name = args[0] + strlen(LUA_STAGE_PREFIX);
+	lua_State *L = filter_state;
+	if (L == NULL || !push_filter(L, name)) {
+		fprintf(stderr, "lush: lua filter not found: %s\n", name);
+		return -1;
+	}
+
+	// the child gets a copy of the loaded state, scripts are not read again
+	// and anything still buffered would be written twice
+	fflush(stdout);
+	fflush(stderr);
+	pid_t pid = lush_fork_stage(input_fd, output_fd, error_fd, pgid);
+	if (pid == 0) {
+		close_inherited_fds();
+		lua_settop(L, 0);
+		push_filter(L, name);
+		_exit(run_filter(L, args));
+	}
+	lua_pop(L, 1);
+	return pid;
+}
+
+static int l_filter(lua_State *L) {
+	const char *name = luaL_checkstring(L, 1);
+	if (!lua_isnoneornil(L, 2))
+		luaL_checktype(L, 2, LUA_TFUNCTION);
+	lua_settop(L, 2);
+	// nil removes the filter again
+	lua_getfield(L, LUA_REGISTRYINDEX, FILTERS_KEY);
+	lua_pushvalue(L, 2);
+	lua_setfield(L, -2, name);
+	return 0;
+}
+
+static void register_filters(lua_State *L) {
+	lua_newtable(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, FILTERS_KEY);
+	filter_state = lua_newthread(L);
+	luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+// -- script builtins --
+
+#define BUILTINS_KEY "lush.builtins"
+
+static int run_lua_builtin(lua_State *L, char ***args) {
+	// the args after the name are passed as strings, an integer result is
+	// the exit status, false means 1 and anything else 0
+	lua_getfield(L, LUA_REGISTRYINDEX, BUILTINS_KEY);
+	lua_getfield(L, -1, args[0][0]);
+	lua_remove(L, -2);
+	int nargs = 0;
+	for (int i = 1; args[0][i]; i++, nargs++)
+		lua_pushstring(L, args[0][i]);
+
+	int status = 0;
+	if (lua_pcall(L, nargs, 1, 0) != LUA_OK) {
+		fprintf(stderr, "lush: %s: %s\n", args[0][0], lua_tostring(L, -1));
+		status = 1;
+	} else if (lua_isinteger(L, -1)) {
+		status = lua_tointeger(L, -1);
+	} else if (lua_isboolean(L, -1) && !lua_toboolean(L, -1)) {
+		status = 1;
+	}
+	lua_pop(L, 1);
+	lush_set_pipestatus(&status, 1);
+	return 1;
+}
+
+static int l_builtin(lua_State *L) {
+	const char *name = luaL_checkstring(L, 1);
+	if (!lua_isnoneornil(L, 2))
+		luaL_checktype(L, 2, LUA_TFUNCTION);
+	lua_settop(L, 2);
+	if (!lush_register_builtin(name, lua_isnil(L, 2) ? NULL : run_lua_builtin))
+		return luaL_error(L, "lush.builtin: %s is a shell builtin", name);
+
+	// nil removes the builtin again
+	lua_getfield(L, LUA_REGISTRYINDEX, BUILTINS_KEY);
+	lua_pushvalue(L, 2);
+	lua_setfield(L, -2, name);
+	return 0;
+}
+
+static void register_builtins(lua_State *L) {
+	lua_newtable(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, BUILTINS_KEY);
 }
 
 // -- Lua wrappers --
 static int l_execute_command(lua_State *L) {
 	const char *command = luaL_checkstring(L, 1);
-	int status = execute_command(L, command);
+	int status = execute_command(L, command, wants_history(L, 2));
 	bool rc = status != -1 ? true : false;
 
-	if (debug_mode) {
-		if (rc)
-			printf("Executed: %s, success\n", command);
-		else
-			printf("Executed: %s, failed\n", command);
+	debug_print_result(command, rc);
+	lua_pushboolean(L, rc);
+	return 1;
+}
+
+static int l_compile(lua_State *L) {
+	const char *command = luaL_checkstring(L, 1);
+	compiled_command_t *compiled =
+		lua_newuserdatauv(L, sizeof(compiled_command_t), 0);
+	lush_arena_init(&compiled->arena);
+	// set before parsing so the arena is freed by __gc on failure too
+	luaL_setmetatable(L, COMMAND_METATABLE);
+
+	if (lush_compile_line(&compiled->arena, command, &compiled->cmdline) ==
+		-1) {
+		fprintf(stderr, "lush: Expected end of quoted string\n");
+		lua_pushnil(L);
+		return 1;
 	}
+	compiled->text = lush_arena_strdup(&compiled->arena, command);
+	return 1;
+}
 
-	lua_pushboolean(L, rc);
+static int l_pipestatus(lua_State *L) {
+	int num_stages = 0;
+	const int *statuses = lush_get_pipestatus(&num_stages);
+	lua_createtable(L, num_stages, 0);
+	for (int i = 0; i < num_stages; i++) {
+		lua_pushinteger(L, statuses[i]);
+		// i + 1 since Lua is 1 based indexed
+		lua_rawseti(L, -2, i + 1);
+	}
 	return 1;
 }
 
@@ -153,6 +1463,47 @@ static int l_get_cwd(lua_State *L) {
 	return 1;
 }
 
+static int l_record_history(lua_State *L) {
+	if (lua_isboolean(L, 1)) {
+		exec_history = lua_toboolean(L, 1);
+	}
+	return 0;
+}
+
+static int l_trace(lua_State *L) {
+	// returns whether tracing was on before
+	bool was_on = lush_trace_enabled();
+	if (lua_isboolean(L, 1))
+		lush_trace_enable(lua_toboolean(L, 1));
+	lua_pushboolean(L, was_on);
+	return 1;
+}
+
+static int l_trace_export(lua_State *L) {
+	const char *path = luaL_checkstring(L, 1);
+	if (!lush_trace_export(path)) {
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(errno));
+		return 2;
+	}
+	lua_pushboolean(L, true);
+	return 1;
+}
+
+static int l_stats(lua_State *L) {
+	lua_createtable(L, 0, LUSH_NUM_STATS + 2);
+	for (int i = 0; i < LUSH_NUM_STATS; i++) {
+		lua_pushinteger(L, lush_stat_get(i));
+		lua_setfield(L, -2, lush_stat_name(i));
+	}
+	// times are in seconds like the rest of the api
+	lua_pushnumber(L, lush_stat_child_total_ns() / 1e9);
+	lua_setfield(L, -2, "child_time_total");
+	lua_pushnumber(L, lush_stat_child_p99_ns() / 1e9);
+	lua_setfield(L, -2, "child_time_p99");
+	return 1;
+}
+
 static int l_debug(lua_State *L) {
 	if (lua_isboolean(L, 1)) {
 		debug_mode = lua_toboolean(L, 1);
@@ -161,104 +1512,228 @@ static int l_debug(lua_State *L) {
 }
 
 static int l_cd(lua_State *L) {
-	const char *newdir = luaL_checkstring(L, 1);
-	char *exp_path = get_expanded_path(newdir);
-	// if the path doesnt exist
-	if (exp_path == NULL) {
+	char buf[PATH_MAX];
+	const char *path = lush_expand_home(luaL_checkstring(L, 1), buf);
+	if (chdir(path) != 0) {
+		// a missing directory is only reported through the result
+		if (errno != ENOENT)
+			perror("lush: cd");
 		lua_pushboolean(L, false);
 		return 1;
 	}
 
-	if (chdir(exp_path) != 0) {
-		perror("lush: cd");
-		free(exp_path);
-		lua_pushboolean(L, false);
-	}
-
+	lush_prompt_invalidate();
 	lua_pushboolean(L, true);
-	free(exp_path);
 	return 1;
 }
 
+// the checks below are a single syscall each on the path as given
+
 static int l_exists(lua_State *L) {
-	const char *check_item = luaL_checkstring(L, 1);
-	char *exp_path = get_expanded_path(check_item);
-	// if the path doesnt exist
-	if (exp_path == NULL) {
-		lua_pushboolean(L, false);
-		return 1;
-	}
-	lua_pushboolean(L, true);
-	free(exp_path);
+	char buf[PATH_MAX];
+	const char *path = lush_expand_home(luaL_checkstring(L, 1), buf);
+	struct stat path_stat;
+	lua_pushboolean(L, stat(path, &path_stat) == 0);
 	return 1;
 }
 
 static int l_is_file(lua_State *L) {
-	const char *check_item = luaL_checkstring(L, 1);
-	char *exp_path = get_expanded_path(check_item);
-	// if the path doesnt exist
-	if (exp_path == NULL) {
-		lua_pushboolean(L, false);
-		return 1;
-	}
+	char buf[PATH_MAX];
+	const char *path = lush_expand_home(luaL_checkstring(L, 1), buf);
 	struct stat path_stat;
-	stat(exp_path, &path_stat);
-	bool rc = S_ISREG(path_stat.st_mode);
-	lua_pushboolean(L, rc);
-	free(exp_path);
+	lua_pushboolean(L, stat(path, &path_stat) == 0 &&
+						   S_ISREG(path_stat.st_mode));
 	return 1;
 }
 
 static int l_is_dir(lua_State *L) {
-	const char *check_item = luaL_checkstring(L, 1);
-	char *exp_path = get_expanded_path(check_item);
-	// if the path doesnt exist
-	if (exp_path == NULL) {
-		lua_pushboolean(L, false);
-		return 1;
-	}
+	char buf[PATH_MAX];
+	const char *path = lush_expand_home(luaL_checkstring(L, 1), buf);
 	struct stat path_stat;
-	stat(exp_path, &path_stat);
-	bool rc = S_ISDIR(path_stat.st_mode);
-	lua_pushboolean(L, rc);
-	free(exp_path);
+	lua_pushboolean(L, stat(path, &path_stat) == 0 &&
+						   S_ISDIR(path_stat.st_mode));
 	return 1;
 }
 
-static int l_is_readable(lua_State *L) {
-	const char *check_item = luaL_checkstring(L, 1);
-	char *exp_path = get_expanded_path(check_item);
-	// if the path doesnt exist
-	if (exp_path == NULL) {
-		lua_pushboolean(L, false);
-		return 1;
+static const char *mode_type(mode_t mode) {
+	if (S_ISREG(mode))
+		return "file";
+	if (S_ISDIR(mode))
+		return "directory";
+	if (S_ISLNK(mode))
+		return "link";
+	if (S_ISFIFO(mode))
+		return "fifo";
+	if (S_ISSOCK(mode))
+		return "socket";
+	if (S_ISCHR(mode))
+		return "char";
+	if (S_ISBLK(mode))
+		return "block";
+	return "unknown";
+}
+
+static void push_time(lua_State *L, struct timespec ts, const char *field) {
+	lua_pushnumber(L, ts.tv_sec + ts.tv_nsec / 1e9);
+	lua_setfield(L, -2, field);
+}
+
+static bool push_stat(lua_State *L, const char *path, bool follow) {
+	// one fstatat fills the whole table, false and errno if it fails
+	char buf[PATH_MAX];
+	struct stat st;
+	if (fstatat(AT_FDCWD, lush_expand_home(path, buf), &st,
+				follow ? 0 : AT_SYMLINK_NOFOLLOW) != 0)
+		return false;
+
+	lua_createtable(L, 0, 12);
+	lua_pushstring(L, mode_type(st.st_mode));
+	lua_setfield(L, -2, "type");
+	lua_pushinteger(L, st.st_size);
+	lua_setfield(L, -2, "size");
+	lua_pushinteger(L, st.st_mode & 07777);
+	lua_setfield(L, -2, "mode");
+	lua_pushinteger(L, st.st_uid);
+	lua_setfield(L, -2, "uid");
+	lua_pushinteger(L, st.st_gid);
+	lua_setfield(L, -2, "gid");
+	lua_pushinteger(L, st.st_ino);
+	lua_setfield(L, -2, "ino");
+	lua_pushinteger(L, st.st_dev);
+	lua_setfield(L, -2, "dev");
+	lua_pushinteger(L, st.st_nlink);
+	lua_setfield(L, -2, "nlink");
+	lua_pushinteger(L, st.st_blocks);
+	lua_setfield(L, -2, "blocks");
+	push_time(L, st.st_atim, "atime");
+	push_time(L, st.st_mtim, "mtime");
+	push_time(L, st.st_ctim, "ctime");
+	return true;
+}
+
+static int l_stat(lua_State *L) {
+	const char *path = luaL_checkstring(L, 1);
+	// links are followed unless false is passed
+	bool follow = lua_isnoneornil(L, 2) || lua_toboolean(L, 2);
+	if (!push_stat(L, path, follow)) {
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(errno));
+		return 2;
 	}
-	bool rc = access(exp_path, R_OK) == 0;
-	lua_pushboolean(L, rc);
-	free(exp_path);
 	return 1;
 }
 
-static int l_is_writeable(lua_State *L) {
-	const char *check_item = luaL_checkstring(L, 1);
-	char *exp_path = get_expanded_path(check_item);
-	// if the path doesnt exist
-	if (exp_path == NULL) {
-		lua_pushboolean(L, false);
-		return 1;
+static int l_stat_all(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	bool follow = lua_isnoneornil(L, 2) || lua_toboolean(L, 2);
+	lua_Integer count = luaL_len(L, 1);
+
+	// one result per path in the same order, false where stat failed
+	lua_createtable(L, count, 0);
+	for (lua_Integer i = 1; i <= count; i++) {
+		lua_rawgeti(L, 1, i);
+		const char *path = lua_tostring(L, -1);
+		bool found = path && push_stat(L, path, follow);
+		if (!found)
+			lua_pushboolean(L, false);
+		lua_rawseti(L, -3, i);
+		lua_pop(L, 1);
 	}
-	bool rc = access(exp_path, W_OK) == 0;
-	lua_pushboolean(L, rc);
-	free(exp_path);
+	return 1;
+}
+
+static const char *dirent_type(unsigned char type) {
+	switch (type) {
+	case DT_REG:
+		return "file";
+	case DT_DIR:
+		return "directory";
+	case DT_LNK:
+		return "link";
+	case DT_FIFO:
+		return "fifo";
+	case DT_SOCK:
+		return "socket";
+	case DT_CHR:
+		return "char";
+	case DT_BLK:
+		return "block";
+	default:
+		return NULL;
+	}
+}
+
+static int l_readdir(lua_State *L) {
+	char buf[PATH_MAX];
+	const char *path = lush_expand_home(luaL_checkstring(L, 1), buf);
+	DIR *dir = opendir(path);
+	if (dir == NULL) {
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(errno));
+		return 2;
+	}
+
+	// entries come in directory order with the type from d_type, only
+	// filesystems that do not report it cost an extra stat
+	lua_newtable(L);
+	lua_Integer count = 0;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+		const char *type = dirent_type(entry->d_type);
+		struct stat st;
+		if (type == NULL)
+			type = fstatat(dirfd(dir), entry->d_name, &st,
+						   AT_SYMLINK_NOFOLLOW) == 0
+					   ? mode_type(st.st_mode)
+					   : "unknown";
+
+		lua_createtable(L, 0, 2);
+		lua_pushstring(L, entry->d_name);
+		lua_setfield(L, -2, "name");
+		lua_pushstring(L, type);
+		lua_setfield(L, -2, "type");
+		lua_rawseti(L, -2, ++count);
+	}
+	closedir(dir);
+	return 1;
+}
+
+static int l_glob(lua_State *L) {
+	const char *pattern = luaL_checkstring(L, 1);
+	lush_glob_cache_t cache;
+	lush_glob_cache_init(&cache);
+	lush_glob_result_t matches = {0};
+	lush_glob(&cache, pattern, &matches);
+	lush_glob_cache_free(&cache);
+
+	// unlike the command line a pattern without matches gives an empty table
+	lua_createtable(L, matches.count, 0);
+	for (size_t i = 0; i < matches.count; i++) {
+		lua_pushstring(L, matches.paths[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+	lush_glob_result_free(&matches);
+	return 1;
+}
+
+static int l_is_readable(lua_State *L) {
+	char buf[PATH_MAX];
+	const char *path = lush_expand_home(luaL_checkstring(L, 1), buf);
+	lua_pushboolean(L, access(path, R_OK) == 0);
+	return 1;
+}
+
+static int l_is_writeable(lua_State *L) {
+	char buf[PATH_MAX];
+	const char *path = lush_expand_home(luaL_checkstring(L, 1), buf);
+	lua_pushboolean(L, access(path, W_OK) == 0);
 	return 1;
 }
 
 static int l_last_history(lua_State *L) {
-	char *history_element = lush_get_past_command(0);
-	// remove the newline character
-	history_element[strlen(history_element) - 1] = '\0';
-	lua_pushstring(L, history_element);
-	free(history_element);
+	lua_pushstring(L, lush_get_past_command(0));
 	return 1;
 }
 
@@ -269,39 +1744,71 @@ static int l_get_history(lua_State *L) {
 	if (i < 1)
 		return 0;
 
-	char *history_element = lush_get_past_command(i - 1);
-	// remove the newline character
-	history_element[strlen(history_element) - 1] = '\0';
-	lua_pushstring(L, history_element);
-	free(history_element);
+	lua_pushstring(L, lush_get_past_command(i - 1));
 	return 1;
 }
 
 static int l_get_env(lua_State *L) {
 	const char *env = luaL_checkstring(L, 1);
-	char *env_val = getenv(env);
-	lua_pushstring(L, env_val);
+	lua_pushstring(L, lush_var_get(env));
 	return 1;
 }
 
 static int l_put_env(lua_State *L) {
+	// the table keeps its own copy, the Lua string may be collected, and
+	// takes care of a new PATH or prompt
 	const char *env = luaL_checkstring(L, 1);
-	putenv((char *)env);
+	if (!lush_var_put(env))
+		return luaL_error(L, "putenv: %s: not a valid name", env);
 	return 0;
 }
 
 // -- register Lua functions --
 
 void lua_register_api(lua_State *L) {
+	register_command_metatable(L);
+	register_lines_metatable(L);
+	register_process_metatable(L);
+	register_filters(L);
+	register_builtins(L);
+
 	// global table for api functions
 	lua_newtable(L);
 
 	lua_pushcfunction(L, l_execute_command);
 	lua_setfield(L, -2, "exec");
+	lua_pushcfunction(L, l_compile);
+	lua_setfield(L, -2, "compile");
+	lua_pushcfunction(L, l_capture);
+	lua_setfield(L, -2, "capture");
+	lua_pushcfunction(L, l_lines);
+	lua_setfield(L, -2, "lines");
+	lua_pushcfunction(L, l_parallel);
+	lua_setfield(L, -2, "parallel");
+	lua_pushcfunction(L, l_spawn);
+	lua_setfield(L, -2, "spawn");
+	lua_pushcfunction(L, l_async);
+	lua_setfield(L, -2, "async");
+	lua_pushcfunction(L, l_run);
+	lua_setfield(L, -2, "run");
+	lua_pushcfunction(L, l_filter);
+	lua_setfield(L, -2, "filter");
+	lua_pushcfunction(L, l_builtin);
+	lua_setfield(L, -2, "builtin");
+	lua_pushcfunction(L, l_pipestatus);
+	lua_setfield(L, -2, "pipestatus");
 	lua_pushcfunction(L, l_get_cwd);
 	lua_setfield(L, -2, "getcwd");
 	lua_pushcfunction(L, l_debug);
 	lua_setfield(L, -2, "debug");
+	lua_pushcfunction(L, l_stats);
+	lua_setfield(L, -2, "stats");
+	lua_pushcfunction(L, l_trace);
+	lua_setfield(L, -2, "trace");
+	lua_pushcfunction(L, l_trace_export);
+	lua_setfield(L, -2, "traceExport");
+	lua_pushcfunction(L, l_record_history);
+	lua_setfield(L, -2, "recordHistory");
 	lua_pushcfunction(L, l_cd);
 	lua_setfield(L, -2, "cd");
 	lua_pushcfunction(L, l_exists);
@@ -310,10 +1817,18 @@ void lua_register_api(lua_State *L) {
 	lua_setfield(L, -2, "isFile");
 	lua_pushcfunction(L, l_is_dir);
 	lua_setfield(L, -2, "isDirectory");
+	lua_pushcfunction(L, l_glob);
+	lua_setfield(L, -2, "glob");
 	lua_pushcfunction(L, l_is_readable);
 	lua_setfield(L, -2, "isReadable");
 	lua_pushcfunction(L, l_is_writeable);
 	lua_setfield(L, -2, "isWriteable");
+	lua_pushcfunction(L, l_stat);
+	lua_setfield(L, -2, "stat");
+	lua_pushcfunction(L, l_stat_all);
+	lua_setfield(L, -2, "statAll");
+	lua_pushcfunction(L, l_readdir);
+	lua_setfield(L, -2, "readdir");
 	lua_pushcfunction(L, l_last_history);
 	lua_setfield(L, -2, "lastHistory");
 	lua_pushcfunction(L, l_get_history);
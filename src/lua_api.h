@@ -19,9 +19,21 @@ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
 #define LUA_API_H
 
 #include <lua.h>
+#include <sys/types.h>
 
-void lua_load_script(lua_State *L, const char *script, char **args);
+// pipeline stages named lua:name run the filter or global function name
+#define LUA_STAGE_PREFIX "lua:"
+
+// runs a script from the current directory or ~/.lush/scripts, 0 on success
+int lua_load_script(lua_State *L, const char *script, char **args);
+// base, string and table now and the other standard libraries on first use
+void lua_open_batch_libs(lua_State *L);
 void lua_register_api(lua_State *L);
+// reap children of collected lush.spawn and lush.lines handles that exited
+void lua_reap_orphans();
+// fork a stage that feeds every line of its stdin through a Lua function
+pid_t lua_spawn_filter(char **args, int input_fd, int output_fd, int error_fd,
+					   pid_t pgid);
 
 #endif
 
@@ -15,67 +15,165 @@ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
 IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
 */
 
+#define _GNU_SOURCE
+
 #include "lush.h"
+#include "completion.h"
+#include "event_loop.h"
+#include "glob.h"
+#include "hashmap.h"
 #include "help.h"
 #include "history.h"
+#include "jobs.h"
 #include "lauxlib.h"
 #include "lua.h"
 #include "lua_api.h"
 #include "lualib.h"
+#include "path_hash.h"
+#include "spawn_helper.h"
+#include "stats.h"
+#include "trace.h"
+#include "vars.h"
 #include <asm-generic/ioctls.h>
 #include <bits/time.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <linux/limits.h>
+#include <math.h>
 #include <pwd.h>
+#include <poll.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+// initial size of the line buffer, it grows as needed
 #define BUFFER_SIZE 1024
 
 // -- builtin functions --
-char *builtin_strs[] = {"cd", "help", "exit", "time"};
+char *builtin_strs[] = {"cd",	 "help",  "exit", "time",  "hash",
+						"rehash", "jobs",  "fg",   "bg",	   "wait",
+						"stats",  "export", "unset"};
 
 int (*builtin_func[])(lua_State *, char ***) = {
-	&lush_cd, &lush_help, &lush_exit, &lush_time, &lush_lua};
+	&lush_cd,	&lush_help, &lush_exit,  &lush_time,	&lush_hash,
+	&lush_rehash, &lush_jobs, &lush_fg,	&lush_bg,	&lush_wait,
+	&lush_stats,	&lush_export, &lush_unset};
 
 int lush_num_builtins() { return sizeof(builtin_strs) / sizeof(char *); }
 
-int lush_cd(lua_State *L, char ***args) {
-	uid_t uid = getuid();
-	struct passwd *pw = getpwuid(uid);
-	if (!pw) {
-		perror("retrieve home dir");
-		return 0;
+typedef struct {
+	lush_builtin_fn func;
+	// registered by a script through lush.builtin
+	bool from_lua;
+} builtin_entry_t;
+
+// every builtin by name, seeded from the arrays above
+static lush_hashmap_t builtin_table;
+static bool builtin_table_ready = false;
+
+static bool add_builtin(const char *name, lush_builtin_fn func, bool from_lua) {
+	builtin_entry_t *entry = malloc(sizeof(builtin_entry_t));
+	if (entry == NULL) {
+		perror("malloc failed");
+		exit(1);
+	}
+	entry->func = func;
+	entry->from_lua = from_lua;
+	if (!lush_hashmap_put(&builtin_table, name, entry)) {
+		free(entry);
+		return false;
 	}
+	return true;
+}
+
+static void init_builtin_table() {
+	if (builtin_table_ready)
+		return;
+	lush_hashmap_init(&builtin_table, free);
+	for (int i = 0; i < lush_num_builtins(); i++)
+		add_builtin(builtin_strs[i], builtin_func[i], false);
+	builtin_table_ready = true;
+}
+
+lush_builtin_fn lush_find_builtin(const char *name) {
+	init_builtin_table();
+	builtin_entry_t *entry = lush_hashmap_get(&builtin_table, name);
+	return entry ? entry->func : NULL;
+}
+
+bool lush_register_builtin(const char *name, lush_builtin_fn func) {
+	init_builtin_table();
+	// the shell's own builtins can not be replaced
+	builtin_entry_t *entry = lush_hashmap_get(&builtin_table, name);
+	if (entry && !entry->from_lua)
+		return false;
+	if (func == NULL) {
+		lush_hashmap_remove(&builtin_table, name);
+		return true;
+	}
+	return add_builtin(name, func, true);
+}
+
+const char *lush_home_dir() {
+	// looked up once, getpwuid can mean a round trip to NSS or LDAP
+	static char *home = NULL;
+	if (home == NULL) {
+		struct passwd *pw = getpwuid(getuid());
+		if (!pw) {
+			perror("retrieve home dir");
+			return NULL;
+		}
+		home = strdup(pw->pw_dir);
+	}
+	return home;
+}
+
+const char *lush_expand_home(const char *path, char *buf) {
+	// only a leading ~ names the home directory, buf holds PATH_MAX bytes
+	if (path[0] != '~' || (path[1] != '/' && path[1] != '\0'))
+		return path;
+	const char *home = lush_home_dir();
+	if (home == NULL ||
+		snprintf(buf, PATH_MAX, "%s%s", home, path + 1) >= PATH_MAX)
+		return path;
+	return buf;
+}
+
+int lush_cd(lua_State *L, char ***args) {
 	if (args[0][1] == NULL) {
-		if (chdir(pw->pw_dir) != 0) {
+		const char *home = lush_home_dir();
+		if (!home)
+			return 1;
+		if (chdir(home) != 0) {
 			perror("lush: cd");
+		} else {
+			lush_prompt_invalidate();
 		}
 	} else {
+		// paths too long for the buffer are left for realpath to reject
 		char path[PATH_MAX];
 		char extended_path[PATH_MAX];
-		char *tilda = strchr(args[0][1], '~');
-		if (tilda) {
-			strcpy(path, pw->pw_dir);
-			strcat(path, tilda + 1);
-		} else {
-			strcpy(path, args[0][1]);
-		}
-		char *exp_path = realpath(path, extended_path);
+		char *exp_path =
+			realpath(lush_expand_home(args[0][1], path), extended_path);
 		if (!exp_path) {
 			perror("realpath");
 			return 1;
 		}
 		if (chdir(exp_path) != 0) {
 			perror("lush: cd");
+		} else {
+			lush_prompt_invalidate();
 		}
 	}
 
@@ -93,38 +191,363 @@ int lush_help(lua_State *L, char ***args) {
 	for (int i = 0; i < lush_num_builtins(); i++) {
 		printf("- %s\n", builtin_strs[i]);
 	}
+
+	// builtins added by scripts
+	init_builtin_table();
+	size_t iter = 0;
+	const char *name;
+	void *value;
+	while (lush_hashmap_next(&builtin_table, &iter, &name, &value)) {
+		if (((builtin_entry_t *)value)->from_lua)
+			printf("- %s (lua)\n", name);
+	}
 	return 1;
 }
 
 int lush_exit(lua_State *L, char ***args) { return 0; }
 
-int lush_time(lua_State *L, char ***args) {
-	// advance past time command
-	args[0]++;
+static bool decode_status(int raw_status, int *status);
+
+// how often a timed pipeline is checked for stopped stages
+#define TIME_STOP_CHECK_MS 100
 
-	// count commands
-	int i = 0;
-	while (args[i++]) {
-		;
+// redirections of the line time was called from, it runs the rest itself
+static lush_redirect_t **time_redirects = NULL;
+
+typedef struct {
+	double wall_ms;
+	double user_ms;
+	double sys_ms;
+	long max_rss_kb;
+	// time from the start of the pipeline until each stage exited
+	double *stage_ms;
+} time_sample_t;
+
+static double elapsed_ms(const struct timespec *start) {
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) * 1000.0 +
+		   (end.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static double timeval_ms(const struct timeval *tv) {
+	return tv->tv_sec * 1000.0 + tv->tv_usec / 1000.0;
+}
+
+static bool runs_in_shell(const char *name) {
+	// scripts and builtins never become a child of their own
+	const char *ext = strchr(name, '.');
+	return (ext && strcmp(ext + 1, "lua") == 0) || lush_find_builtin(name);
+}
+
+static void time_pipeline(char ***commands, int num_commands,
+						  time_sample_t *sample) {
+	// stages are reaped in the order they finish using their pidfds, so
+	// each one gets its own end time and rusage from wait4
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	lush_job_t job;
+	if (lush_start_pipeline(&job, commands, time_redirects, num_commands,
+							STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO,
+							false) == -1)
+		return;
+
+	struct pollfd *fds = malloc(num_commands * sizeof(struct pollfd));
+	bool *reaped = calloc(num_commands, sizeof(bool));
+	if (!fds || !reaped) {
+		perror("malloc failed");
+		exit(1);
+	}
+	int remaining = 0;
+	bool fallback = false;
+	for (int i = 0; i < num_commands; i++) {
+		fds[i].fd = job.pids[i] > 0 ? lush_pidfd_open(job.pids[i]) : -1;
+		fds[i].events = POLLIN;
+		if (job.pids[i] > 0) {
+			remaining++;
+			fallback = fallback || fds[i].fd == -1;
+		} else {
+			reaped[i] = true;
+		}
 	}
 
-	// get time
-	struct timespec start, end;
-	double elapsed_time;
+	while (remaining > 0) {
+		// without pidfds the stages are checked every millisecond, pidfds
+		// never report a stop so those are looked for every so often
+		poll(fds, num_commands, fallback ? 1 : TIME_STOP_CHECK_MS);
+		for (int i = 0; i < num_commands; i++) {
+			if (reaped[i])
+				continue;
+			int raw_status;
+			struct rusage usage;
+			if (wait4(job.pids[i], &raw_status, WNOHANG | WUNTRACED, &usage) <=
+				0)
+				continue;
+			// the timed pipeline is not in the job table, so like in
+			// wait_for_child a stopped stage is resumed rather than left
+			// for an fg that could never find it
+			if (WIFSTOPPED(raw_status)) {
+				kill(job.pids[i], SIGCONT);
+				continue;
+			}
+			sample->stage_ms[i] = elapsed_ms(&start);
+			sample->user_ms += timeval_ms(&usage.ru_utime);
+			sample->sys_ms += timeval_ms(&usage.ru_stime);
+			if (usage.ru_maxrss > sample->max_rss_kb)
+				sample->max_rss_kb = usage.ru_maxrss;
+			decode_status(raw_status, &job.statuses[i]);
+			lush_stat_child_reaped(job.pids[i]);
+			lush_trace_process_exit(job.pids[i], job.statuses[i]);
+			reaped[i] = true;
+			remaining--;
+			if (fds[i].fd != -1) {
+				close(fds[i].fd);
+				fds[i].fd = -1;
+			}
+		}
+	}
+	sample->wall_ms = elapsed_ms(&start);
 
+	lush_set_pipestatus(job.statuses, num_commands);
+	free(fds);
+	free(reaped);
+	lush_free_job(&job);
+}
+
+static int time_in_shell(lua_State *L, char ***args, int num_commands,
+						 time_sample_t *sample) {
+	// only the children as a whole can be measured here
+	struct rusage before, after;
+	struct timespec start;
+	getrusage(RUSAGE_CHILDREN, &before);
 	clock_gettime(CLOCK_MONOTONIC, &start);
-	int rc = lush_run(L, args, i);
-	clock_gettime(CLOCK_MONOTONIC, &end);
+	int rc = lush_run(L, args, time_redirects, num_commands, false);
+	sample->wall_ms = elapsed_ms(&start);
+	getrusage(RUSAGE_CHILDREN, &after);
+	sample->user_ms =
+		timeval_ms(&after.ru_utime) - timeval_ms(&before.ru_utime);
+	sample->sys_ms = timeval_ms(&after.ru_stime) - timeval_ms(&before.ru_stime);
+	sample->max_rss_kb = after.ru_maxrss;
+	return rc;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static void print_time_stats(double *wall, int runs) {
+	double sum = 0, min = wall[0], max = wall[0];
+	for (int i = 0; i < runs; i++) {
+		sum += wall[i];
+		if (wall[i] < min)
+			min = wall[i];
+		if (wall[i] > max)
+			max = wall[i];
+	}
+	double mean = sum / runs;
+	double variance = 0;
+	for (int i = 0; i < runs; i++)
+		variance += (wall[i] - mean) * (wall[i] - mean);
+	double stddev = runs > 1 ? sqrt(variance / (runs - 1)) : 0;
+
+	qsort(wall, runs, sizeof(double), compare_doubles);
+	double median = runs % 2 ? wall[runs / 2]
+							 : (wall[runs / 2 - 1] + wall[runs / 2]) / 2;
+	printf("Time: %.3f ms mean, %.3f ms median, %.3f ms stddev, "
+		   "%.3f ms min, %.3f ms max over %d runs\n",
+		   mean, median, stddev, min, max, runs);
+}
+
+int lush_time(lua_State *L, char ***args) {
+	// time [-n runs] [--warmup runs] command
+	int runs = 1;
+	int warmup = 0;
+	int skip = 1;
+	while (args[0][skip]) {
+		int *target = NULL;
+		if (strcmp(args[0][skip], "-n") == 0)
+			target = &runs;
+		else if (strcmp(args[0][skip], "--warmup") == 0)
+			target = &warmup;
+		else
+			break;
+		if (args[0][skip + 1] == NULL || atoi(args[0][skip + 1]) < 0) {
+			fprintf(stderr, "lush: time: %s needs a count\n", args[0][skip]);
+			return 1;
+		}
+		*target = atoi(args[0][skip + 1]);
+		skip += 2;
+	}
+	if (runs < 1)
+		runs = 1;
+	if (args[0][skip] == NULL)
+		return 1;
 
-	elapsed_time = (end.tv_sec - start.tv_sec) * 1000.0 +
-				   (end.tv_nsec - start.tv_nsec) / 1e6;
-	printf("Time: %.3f milliseconds\n", elapsed_time);
+	// advance past time command and its options
+	args[0] += skip;
+	int num_commands = 0;
+	while (args[num_commands])
+		num_commands++;
+	bool in_shell = runs_in_shell(args[0][0]);
+
+	double *wall = malloc(runs * sizeof(double));
+	double *stage_ms = calloc(num_commands, sizeof(double));
+	double *stage_total = calloc(num_commands, sizeof(double));
+	if (!wall || !stage_ms || !stage_total) {
+		perror("malloc failed");
+		exit(1);
+	}
+	double user_ms = 0, sys_ms = 0;
+	long max_rss_kb = 0;
+	int rc = 1;
+
+	for (int i = 0; i < warmup + runs && rc != 0; i++) {
+		time_sample_t sample = {0, 0, 0, 0, stage_ms};
+		if (in_shell) {
+			rc = time_in_shell(L, args, num_commands, &sample);
+		} else {
+			time_pipeline(args, num_commands, &sample);
+		}
+		// warmup runs fill caches and are not counted
+		if (i < warmup)
+			continue;
+		wall[i - warmup] = sample.wall_ms;
+		user_ms += sample.user_ms;
+		sys_ms += sample.sys_ms;
+		if (sample.max_rss_kb > max_rss_kb)
+			max_rss_kb = sample.max_rss_kb;
+		for (int j = 0; j < num_commands; j++)
+			stage_total[j] += stage_ms[j];
+	}
+
+	if (rc != 0) {
+		if (runs == 1)
+			printf("Time: %.3f milliseconds\n", wall[0]);
+		else
+			print_time_stats(wall, runs);
+		printf("CPU: %.3f ms user, %.3f ms sys, %ld KB max RSS%s\n",
+			   user_ms / runs, sys_ms / runs, max_rss_kb,
+			   runs > 1 ? " per run" : "");
+		for (int j = 0; j < num_commands && !in_shell && num_commands > 1;
+			 j++) {
+			printf("Stage %d (%s): %.3f ms\n", j + 1, args[j][0],
+				   stage_total[j] / runs);
+		}
+	}
 
+	free(wall);
+	free(stage_ms);
+	free(stage_total);
 	// return pointer back to "time" for free()
-	args[0]--;
+	args[0] -= skip;
 	return rc;
 }
 
+int lush_hash(lua_State *L, char ***args) {
+	if (args[0][1] == NULL) {
+		lush_path_print();
+		return 1;
+	}
+
+	for (int i = 1; args[0][i]; i++) {
+		if (strcmp(args[0][i], "-r") == 0) {
+			lush_path_rehash();
+		} else if (!lush_path_hash(args[0][i])) {
+			fprintf(stderr, "lush: hash: %s: not found\n", args[0][i]);
+		}
+	}
+	return 1;
+}
+
+int lush_rehash(lua_State *L, char ***args) {
+	lush_path_rehash();
+	return 1;
+}
+
+int lush_stats(lua_State *L, char ***args) {
+	// one name and value per line so monitoring can scrape it as is
+	for (int i = 0; i < LUSH_NUM_STATS; i++)
+		printf("%s %llu\n", lush_stat_name(i),
+			   (unsigned long long)lush_stat_get(i));
+	printf("child_time_total_ms %.3f\n", lush_stat_child_total_ns() / 1e6);
+	printf("child_time_p99_ms %.3f\n", lush_stat_child_p99_ns() / 1e6);
+	return 1;
+}
+
+int lush_export(lua_State *L, char ***args) {
+	if (args[0][1] == NULL) {
+		lush_var_print_exported();
+		return 1;
+	}
+
+	for (int i = 1; args[0][i]; i++) {
+		const char *arg = args[0][i];
+		bool ok;
+		if (strchr(arg, '='))
+			ok = lush_is_assignment(arg) && lush_var_put(arg);
+		else
+			ok = lush_var_export(arg) || lush_var_set(arg, "", true);
+		if (!ok)
+			fprintf(stderr, "lush: export: %s: not a valid name\n", arg);
+	}
+	return 1;
+}
+
+int lush_unset(lua_State *L, char ***args) {
+	for (int i = 1; args[0][i]; i++)
+		lush_var_unset(args[0][i]);
+	return 1;
+}
+
+static bool set_assignments(char **args) {
+	// a command of nothing but NAME=value words sets shell variables, the
+	// ones that were already exported stay exported
+	for (int i = 0; args[i]; i++) {
+		if (!lush_is_assignment(args[i]))
+			return false;
+	}
+	for (int i = 0; args[i]; i++) {
+		char *eq = strchr(args[i], '=');
+		*eq = '\0';
+		lush_var_set(args[i], eq + 1, false);
+		*eq = '=';
+	}
+	return true;
+}
+
+int lush_jobs(lua_State *L, char ***args) {
+	lush_jobs_print();
+	return 1;
+}
+
+int lush_fg(lua_State *L, char ***args) {
+	const char *spec = args[0][1];
+	if (lush_jobs_fg(spec) == -1)
+		fprintf(stderr, "lush: fg: %s: no such job\n", spec ? spec : "current");
+	return 1;
+}
+
+int lush_bg(lua_State *L, char ***args) {
+	const char *spec = args[0][1];
+	if (lush_jobs_bg(spec) == -1)
+		fprintf(stderr, "lush: bg: %s: no such job\n", spec ? spec : "current");
+	return 1;
+}
+
+int lush_wait(lua_State *L, char ***args) {
+	if (args[0][1] == NULL) {
+		lush_jobs_wait(NULL);
+		return 1;
+	}
+	for (int i = 1; args[0][i]; i++) {
+		if (lush_jobs_wait(args[0][i]) == -1)
+			fprintf(stderr, "lush: wait: %s: no such job\n", args[0][i]);
+	}
+	return 1;
+}
+
 int lush_lua(lua_State *L, char ***args) {
 	// run the lua file given
 	const char *script = args[0][0];
@@ -154,221 +577,738 @@ static void reset_terminal_mode(struct termios *orig_termios) {
 	tcsetattr(STDIN_FILENO, TCSANOW, orig_termios);
 }
 
-static int get_terminal_width() {
+// cached so redraws never need an ioctl, refreshed on SIGWINCH
+static volatile sig_atomic_t terminal_width = 80;
+
+static void update_terminal_width() {
 	struct winsize w;
-	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == -1) {
-		perror("ioctl");
-		return -1;
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == 0 && w.ws_col > 0) {
+		terminal_width = w.ws_col;
+	}
+}
+
+static void handle_sigwinch(int sig) {
+	// ioctl is async signal safe so the width can be read right here
+	int saved_errno = errno;
+	update_terminal_width();
+	errno = saved_errno;
+}
+
+static int get_terminal_width() { return terminal_width; }
+
+// -- output batching --
+
+// a whole redraw is assembled here and sent with a single write
+typedef struct {
+	char *data;
+	size_t len;
+	size_t cap;
+} output_buffer_t;
+
+static output_buffer_t output = {NULL, 0, 0};
+
+static void output_append(const char *str, size_t len) {
+	if (output.len + len > output.cap) {
+		size_t new_cap = output.cap ? output.cap * 2 : 256;
+		while (new_cap < output.len + len)
+			new_cap *= 2;
+		char *data = realloc(output.data, new_cap);
+		if (data == NULL) {
+			perror("realloc failed");
+			exit(1);
+		}
+		output.data = data;
+		output.cap = new_cap;
 	}
-	return w.ws_col;
+	memcpy(output.data + output.len, str, len);
+	output.len += len;
+}
+
+static void output_append_str(const char *str) {
+	output_append(str, strlen(str));
 }
 
-static char *get_prompt() {
-	char *username = getenv("USER");
+static void output_append_escape(int count, char command) {
+	// cursor movement sequence such as \033[3A
+	char escape[32];
+	int len = snprintf(escape, sizeof(escape), "\033[%d%c", count, command);
+	output_append(escape, len);
+}
+
+static void output_flush() {
+	// anything printed through stdio has to land before the redraw
+	fflush(stdout);
+	size_t written = 0;
+	while (written < output.len) {
+		ssize_t n = write(STDOUT_FILENO, output.data + written,
+						  output.len - written);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		written += n;
+	}
+	lush_stat_add(LUSH_STAT_REDRAW_BYTES, written);
+	output.len = 0;
+}
+
+// -- prompt cache --
+
+typedef struct {
+	char *text;
+	size_t len;
+	// number of terminal columns the prompt takes up
+	int width;
+	bool valid;
+} prompt_t;
+
+static prompt_t prompt = {NULL, 0, 0, false};
+
+void lush_prompt_invalidate() { prompt.valid = false; }
+
+static int get_display_width(const char *str) {
+	// count utf-8 lead bytes so multibyte characters take one column
+	int width = 0;
+	for (const char *c = str; *c; c++) {
+		if ((*c & 0xC0) != 0x80)
+			width++;
+	}
+	return width;
+}
+
+static void build_prompt() {
+	uint64_t trace_start = lush_trace_begin();
+	const char *username = lush_var_get("USER");
+	if (username == NULL)
+		username = "";
 	char device_name[256];
-	gethostname(device_name, sizeof(device_name));
+	if (gethostname(device_name, sizeof(device_name)) != 0)
+		device_name[0] = '\0';
+	device_name[sizeof(device_name) - 1] = '\0';
 	char *cwd = getcwd(NULL, 0);
 
 	// Replace /home/<user> with ~
 	char *home_prefix = "/home/";
 	size_t home_len = strlen(home_prefix) + strlen(username);
-	char *prompt_cwd;
-	if (strncmp(cwd, home_prefix, strlen(home_prefix)) == 0 &&
+	const char *prompt_cwd = cwd ? cwd : "?";
+	const char *tilda = "";
+	if (cwd && strncmp(cwd, home_prefix, strlen(home_prefix)) == 0 &&
 		strncmp(cwd + strlen(home_prefix), username, strlen(username)) == 0) {
-		prompt_cwd = malloc(strlen(cwd) - home_len +
-							2); // 1 for ~ and 1 for null terminator
-		snprintf(prompt_cwd, strlen(cwd) - home_len + 2, "~%s", cwd + home_len);
-	} else {
-		prompt_cwd = strdup(cwd);
+		tilda = "~";
+		prompt_cwd = cwd + home_len;
 	}
 
-	// Print the prompt
-	size_t prompt_len =
-		strlen(prompt_cwd) + strlen(username) + strlen(device_name) + 6;
-	char *prompt = (char *)malloc(prompt_len);
-	snprintf(prompt, prompt_len, "[%s@%s:%s]", username, device_name,
+	size_t prompt_len = strlen(prompt_cwd) + strlen(username) +
+						strlen(device_name) + 6; // [@:], ~ and terminator
+	char *text = realloc(prompt.text, prompt_len);
+	if (text == NULL) {
+		perror("realloc failed");
+		exit(1);
+	}
+	snprintf(text, prompt_len, "[%s@%s:%s%s]", username, device_name, tilda,
 			 prompt_cwd);
-
 	free(cwd);
-	return prompt;
+
+	prompt.text = text;
+	prompt.len = strlen(text);
+	prompt.width = get_display_width(text);
+	prompt.valid = true;
+	lush_trace_span("prompt", trace_start, NULL);
 }
 
-static void reprint_buffer(char *buffer, int *last_lines, int *pos,
-						   int history_pos) {
-	char *prompt = get_prompt();
-	int width = get_terminal_width();
+static const prompt_t *get_prompt() {
+	// only rebuilt after cd or an environment change invalidates it
+	if (!prompt.valid)
+		build_prompt();
+	return &prompt;
+}
+
+// -- line editing --
+
+typedef struct {
+	char *data;
+	size_t len;
+	size_t cap;
+} line_buffer_t;
+
+static void line_reserve(line_buffer_t *line, size_t len) {
+	if (len + 1 <= line->cap)
+		return;
+	size_t new_cap = line->cap ? line->cap : BUFFER_SIZE;
+	while (new_cap < len + 1)
+		new_cap *= 2;
+	char *data = realloc(line->data, new_cap);
+	if (data == NULL) {
+		perror("realloc failed");
+		exit(1);
+	}
+	line->data = data;
+	line->cap = new_cap;
+}
+
+static void line_insert(line_buffer_t *line, size_t pos, const char *str,
+						size_t len) {
+	line_reserve(line, line->len + len);
+	memmove(&line->data[pos + len], &line->data[pos], line->len - pos + 1);
+	memcpy(&line->data[pos], str, len);
+	line->len += len;
+}
+
+static void line_delete(line_buffer_t *line, size_t pos) {
+	memmove(&line->data[pos], &line->data[pos + 1], line->len - pos);
+	line->len--;
+}
+
+static void line_set(line_buffer_t *line, const char *str) {
+	size_t len = strlen(str);
+	line_reserve(line, len);
+	memcpy(line->data, str, len + 1);
+	line->len = len;
+}
+
+// -- input reading --
+
+// stdin is read in chunks, pending bytes carry over to the next line
+static char input_buffer[4096];
+static size_t input_len = 0;
+static size_t input_pos = 0;
+
+static int read_byte() {
+	if (input_pos == input_len) {
+		ssize_t n;
+		do {
+			n = read(STDIN_FILENO, input_buffer, sizeof(input_buffer));
+		} while (n == -1 && errno == EINTR);
+		if (n <= 0)
+			return -1;
+		input_len = n;
+		input_pos = 0;
+	}
+	return (unsigned char)input_buffer[input_pos++];
+}
+
+static bool input_pending() {
+	if (input_pos < input_len)
+		return true;
+	struct pollfd pfd = {.fd = STDIN_FILENO, .events = POLLIN};
+	return poll(&pfd, 1, 0) > 0;
+}
+
+static int read_escape(int *param) {
+	// returns the final byte of a CSI sequence and its first parameter
+	int c = read_byte();
+	if (c != '[' && c != 'O')
+		return 0;
 
-	// handle history before doing calculations
-	if (history_pos >= 0) {
-		char *history_line = lush_get_past_command(history_pos);
-		if (history_line != NULL) {
-			strncpy(buffer, history_line, BUFFER_SIZE);
-			free(history_line);
-			// remove newline from buffer
-			buffer[strlen(buffer) - 1] = '\0';
-			*pos = strlen(buffer);
+	bool first_param = true;
+	*param = 0;
+	while ((c = read_byte()) != -1) {
+		if (c >= '0' && c <= '9') {
+			if (first_param)
+				*param = *param * 10 + (c - '0');
+		} else if (c == ';') {
+			first_param = false;
+		} else {
+			return c;
 		}
 	}
+	return 0;
+}
+
+static void read_paste(line_buffer_t *line, size_t *pos) {
+	// everything up to the end marker is inserted as one edit
+	static const char end_marker[] = "\033[201~";
+	size_t marker_len = strlen(end_marker);
+	line_buffer_t paste = {NULL, 0, 0};
+	line_reserve(&paste, 0);
+	size_t matched = 0;
+	int c;
 
-	int num_lines = ((strlen(buffer) + strlen(prompt) + 1) / width) + 1;
-	int cursor_pos = (strlen(prompt) + *pos + 1) % width;
-	int cursor_line = (strlen(prompt) + *pos + 1) / width + 1;
-	// move cursor down if it is up a number of lines first
-	if (num_lines - cursor_line > 0) {
-		printf("\033[%dB", num_lines - cursor_line);
-		// compensate for if the we have just filled a line
-		if ((strlen(buffer) + strlen(prompt) + 1) % width == 0) {
-			printf("\033[A");
+	while ((c = read_byte()) != -1) {
+		if (c == end_marker[matched]) {
+			if (++matched == marker_len)
+				break;
+			continue;
+		}
+		if (matched > 0) {
+			// false start, keep what looked like the marker
+			line_insert(&paste, paste.len, end_marker, matched);
+			matched = 0;
+			if (c == end_marker[0]) {
+				matched = 1;
+				continue;
+			}
 		}
+		// the line has to stay a single command
+		char ch = (c == '\n' || c == '\r') ? ' ' : c;
+		line_insert(&paste, paste.len, &ch, 1);
 	}
-	for (int i = 0; i < *last_lines; i++) {
-		printf("\r\033[K");
-		if (i > 0)
-			printf("\033[A");
+
+	line_insert(line, *pos, paste.data, paste.len);
+	*pos += paste.len;
+	free(paste.data);
+}
+
+static void load_history(line_buffer_t *line, size_t *pos, int history_pos) {
+	const char *history_line = lush_get_past_command(history_pos);
+	if (history_line != NULL) {
+		line_set(line, history_line);
+		*pos = line->len;
 	}
-	*last_lines = num_lines;
+}
+
+static void draw_line(const char *lead, size_t lead_len, int lead_width,
+					  line_buffer_t *line, int *cursor_row, size_t pos) {
+	int width = get_terminal_width();
 
-	// ensure line is cleared before printing
-	printf("\r\033[K");
-	printf("%s ", prompt);
-	printf("%s ", buffer);
+	// columns written: lead, space, buffer and a trailing space
+	int end = lead_width + line->len + 2;
+	int end_row = (end - 1) / width;
+	int target = lead_width + pos + 1;
+	int target_row = target / width;
+	int target_col = target % width;
+
+	// go back to the first line of the prompt and clear everything below
+	if (*cursor_row > 0)
+		output_append_escape(*cursor_row, 'A');
+	output_append_str("\r\033[J");
+
+	output_append(lead, lead_len);
+	output_append(" ", 1);
+	output_append(line->data, line->len);
+	output_append(" ", 1);
 
 	// move cursor up and to the right to be in correct position
-	if (cursor_pos > 0)
-		printf("\r\033[%dC", cursor_pos);
-	else
-		printf("\r");
-	if (num_lines > 1 && (num_lines - cursor_line) > 0)
-		printf("\033[%dA", num_lines - cursor_line);
+	if (end_row > target_row)
+		output_append_escape(end_row - target_row, 'A');
+	output_append("\r", 1);
+	if (target_col > 0)
+		output_append_escape(target_col, 'C');
+	*cursor_row = target_row;
+
+	output_flush();
+}
+
+static int step_history(const line_buffer_t *line, int history_pos,
+						const char *prefix, bool older) {
+	// the next command with the prefix, repeats of the shown one are skipped
+	int found = history_pos;
+	do {
+		found = lush_history_search(prefix, older ? found + 1 : found - 1,
+									true, older);
+	} while (found != -1 &&
+			 strcmp(lush_get_past_command(found), line->data) == 0);
+	return found;
+}
+
+static void reprint_buffer(line_buffer_t *line, int *cursor_row, size_t pos) {
+	const prompt_t *prompt = get_prompt();
+	draw_line(prompt->text, prompt->len, prompt->width, line, cursor_row, pos);
+}
+
+// -- history search --
+
+static void draw_search(const line_buffer_t *query, bool failed,
+						line_buffer_t *line, int *cursor_row, size_t pos) {
+	line_buffer_t lead = {NULL, 0, 0};
+	line_reserve(&lead, query->len + 32);
+	lead.len = snprintf(lead.data, lead.cap, "(%sreverse-i-search)`%s':",
+						failed ? "failed " : "", query->data);
+	draw_line(lead.data, lead.len, get_display_width(lead.data), line,
+			  cursor_row, pos);
+	free(lead.data);
+}
+
+static bool show_match(line_buffer_t *line, size_t *pos, const char *query,
+					   int found, int *match) {
+	if (found == -1)
+		return false;
+	*match = found;
+	line_set(line, lush_get_past_command(found));
+	*pos = strstr(line->data, query) - line->data;
+	return true;
+}
+
+static bool search_history(line_buffer_t *line, size_t *pos,
+						   int *cursor_row) {
+	// incremental Ctrl-R, every key searches the history index again,
+	// returns true if the match should be run straight away
+	line_buffer_t query = {NULL, 0, 0};
+	line_reserve(&query, 0);
+	query.data[0] = '\0';
+	char *saved = strdup(line->data);
+	size_t saved_pos = *pos;
+	int match = -1;
+	bool failed = false;
+	bool run = false;
+
+	while (true) {
+		if (!input_pending())
+			draw_search(&query, failed, line, cursor_row, *pos);
+
+		int c = read_byte();
+		if (c == -1 || c == '\a') {
+			// Ctrl-G gives back the line from before the search
+			line_set(line, saved);
+			*pos = saved_pos;
+			break;
+		} else if (c == '\022') {
+			// next older match of the same text
+			if (query.len > 0)
+				failed = !show_match(
+					line, pos, query.data,
+					lush_history_search(query.data, match + 1, false, true),
+					&match);
+		} else if (c == '\177') {
+			if (query.len > 0)
+				query.data[--query.len] = '\0';
+			match = -1;
+			failed = query.len > 0 &&
+					 !show_match(line, pos, query.data,
+								 lush_history_search(query.data, 0, false, true),
+								 &match);
+		} else if (c == '\n') {
+			run = true;
+			break;
+		} else if (c == '\033') {
+			// any movement leaves the match in the buffer for editing
+			int param;
+			read_escape(&param);
+			break;
+		} else if (c >= ' ') {
+			char ch = c;
+			line_insert(&query, query.len, &ch, 1);
+			// the current match may still hold the longer text
+			failed = !show_match(
+				line, pos, query.data,
+				lush_history_search(query.data, match < 0 ? 0 : match, false,
+									true),
+				&match);
+		}
+	}
+
+	free(saved);
+	free(query.data);
+	return run;
+}
+
+// -- tab completion --
+
+// more candidates than this are counted instead of listed
+#define MAX_LISTED_MATCHES 256
+
+static void list_matches(const lush_completion_t *completion,
+						 const line_buffer_t *line, int *cursor_row) {
+	const prompt_t *prompt = get_prompt();
+	int width = get_terminal_width();
+
+	// print below the line, the prompt is drawn again underneath
+	int end_row = (prompt->width + line->len + 1) / width;
+	if (end_row > *cursor_row)
+		output_append_escape(end_row - *cursor_row, 'B');
+	output_append_str("\r\n");
+	*cursor_row = 0;
+
+	if (completion->count > MAX_LISTED_MATCHES) {
+		char message[64];
+		int len = snprintf(message, sizeof(message), "%zu possibilities\r\n",
+						   completion->count);
+		output_append(message, len);
+		return;
+	}
+
+	// only the last part of a path is shown, like ls would
+	size_t longest = 0;
+	for (size_t i = 0; i < completion->count; i++) {
+		const char *match = completion->matches[i];
+		const char *slash = strrchr(match, '/');
+		if (slash && slash[1] == '\0')
+			slash = memrchr(match, '/', slash - match);
+		size_t len = strlen(slash ? slash + 1 : match);
+		if (len > longest)
+			longest = len;
+	}
+	int columns = width / (longest + 2);
+	if (columns < 1)
+		columns = 1;
+
+	for (size_t i = 0; i < completion->count; i++) {
+		const char *match = completion->matches[i];
+		const char *slash = strrchr(match, '/');
+		if (slash && slash[1] == '\0')
+			slash = memrchr(match, '/', slash - match);
+		const char *name = slash ? slash + 1 : match;
+		size_t len = strlen(name);
+		output_append(name, len);
+		if ((i + 1) % columns == 0 || i + 1 == completion->count) {
+			output_append_str("\r\n");
+		} else {
+			for (size_t pad = len; pad < longest + 2; pad++)
+				output_append(" ", 1);
+		}
+	}
+}
+
+static bool complete_word(line_buffer_t *line, size_t *pos, bool list,
+						  int *cursor_row) {
+	// the word is whatever sits between the last separator and the cursor
+	size_t start = *pos;
+	while (start > 0 && line->data[start - 1] != ' ' &&
+		   line->data[start - 1] != '|')
+		start--;
+	if (line->data[start] == '$' || line->data[start] == '"')
+		return false;
+	// the first word of a command names a program
+	size_t before = start;
+	while (before > 0 && line->data[before - 1] == ' ')
+		before--;
+	bool command = before == 0 || line->data[before - 1] == '|';
+
+	size_t word_len = *pos - start;
+	char *word = strndup(line->data + start, word_len);
+	if (word == NULL) {
+		perror("strndup failed");
+		exit(1);
+	}
+	lush_completion_t completion = {NULL, 0, 0};
+	lush_complete(word, command, &completion);
+	free(word);
+	if (completion.count == 0)
+		return false;
+
+	// everything the candidates agree on can be typed in at once
+	const char *first = completion.matches[0];
+	size_t common = strlen(first);
+	for (size_t i = 1; i < completion.count; i++) {
+		size_t k = 0;
+		while (k < common && completion.matches[i][k] == first[k])
+			k++;
+		common = k;
+	}
 
-	free(prompt);
+	bool changed = false;
+	if (common > word_len) {
+		line_insert(line, *pos, first + word_len, common - word_len);
+		*pos += common - word_len;
+		changed = true;
+	}
+	if (completion.count == 1 && first[common - 1] != '/') {
+		line_insert(line, *pos, " ", 1);
+		(*pos)++;
+		changed = true;
+	} else if (!changed && list) {
+		list_matches(&completion, line, cursor_row);
+		changed = true;
+	}
+	lush_completion_free(&completion);
+	return changed;
 }
 
 char *lush_read_line() {
 	struct termios orig_termios;
-	char *buffer = (char *)calloc(BUFFER_SIZE, sizeof(char));
-	int pos = 0;
+	line_buffer_t line = {NULL, 0, 0};
+	line_reserve(&line, 0);
+	line.data[0] = '\0';
+	size_t pos = 0;
 	int history_pos = -1;
-	int last_lines = 1;
-	char last_command;
-	int c;
+	int cursor_row = 0;
+	bool redraw = true;
+	// a second tab in a row lists the candidates
+	bool listing_tab = false;
+	// up and down only visit commands starting with this
+	char *history_prefix = NULL;
 
 	// init buffer and make raw mode
 	set_raw_mode(&orig_termios);
+	// bracketed paste lets a whole paste arrive as one edit
+	output_append_str("\033[?2004h");
 
 	while (true) {
-		c = getchar();
+		// skip redraws while more input is already waiting
+		if (redraw && !input_pending()) {
+			reprint_buffer(&line, &cursor_row, pos);
+			redraw = false;
+		}
+
+		int c = read_byte();
+		if (c == -1) {
+			// stdin was closed
+			free(line.data);
+			line.data = NULL;
+			break;
+		}
+
+		if (c == '\t') {
+			bool changed =
+				complete_word(&line, &pos, listing_tab, &cursor_row);
+			if (changed) {
+				history_pos = -1;
+				redraw = true;
+			}
+			listing_tab = !changed;
+			continue;
+		}
+		listing_tab = false;
 
 		if (c == '\033') { // escape sequence
-			getchar();	   // skip [
-			switch (getchar()) {
+			int param = 0;
+			int found;
+			switch (read_escape(&param)) {
 			case 'A': // up arrow
-				reprint_buffer(buffer, &last_lines, &pos, ++history_pos);
+				// what was typed before browsing limits it to that prefix
+				if (history_pos == -1) {
+					free(history_prefix);
+					history_prefix = strdup(line.data);
+				}
+				found = step_history(&line, history_pos, history_prefix, true);
+				if (found != -1) {
+					history_pos = found;
+					load_history(&line, &pos, history_pos);
+				}
+				redraw = true;
 				break;
 			case 'B': // down arrow
-				reprint_buffer(buffer, &last_lines, &pos, --history_pos);
-				if (history_pos < 0)
-					history_pos = 0;
+				if (history_pos == -1)
+					break;
+				history_pos =
+					step_history(&line, history_pos, history_prefix, false);
+				if (history_pos != -1) {
+					load_history(&line, &pos, history_pos);
+				} else {
+					// past the newest match the typed text comes back
+					line_set(&line, history_prefix);
+					pos = line.len;
+				}
+				redraw = true;
 				break;
 			case 'C': // right arrow
-			{
-				int width = get_terminal_width();
-				char *prompt = get_prompt();
-				if ((strlen(prompt) + pos) % width == width - 2) {
-					printf("\033[B");
-				}
-				if (pos < strlen(buffer)) {
+				if (pos < line.len) {
 					pos++;
 					// if modifying text reset history
 					history_pos = -1;
-					reprint_buffer(buffer, &last_lines, &pos, history_pos);
+					redraw = true;
 				}
-				free(prompt);
-			} break;
+				break;
 			case 'D': // left arrow
-			{
-				int width = get_terminal_width();
-				char *prompt = get_prompt();
-				if ((strlen(prompt) + pos) % width == width - 1) {
-					printf("\033[A");
-				}
-
 				if (pos > 0) {
 					pos--;
 					// if modifying text reset history
 					history_pos = -1;
-					reprint_buffer(buffer, &last_lines, &pos, history_pos);
+					redraw = true;
 				}
-				free(prompt);
-			} break;
-			case '3': // delete
-				if (getchar() == '~') {
-					if (pos < strlen(buffer)) {
-						memmove(&buffer[pos], &buffer[pos + 1],
-								strlen(&buffer[pos + 1]) + 1);
-						// if modifying text reset history
-						history_pos = -1;
-						reprint_buffer(buffer, &last_lines, &pos, history_pos);
-					}
+				break;
+			case '~':
+				if (param == 3 && pos < line.len) { // delete
+					line_delete(&line, pos);
+					// if modifying text reset history
+					history_pos = -1;
+					redraw = true;
+				} else if (param == 200) { // start of a paste
+					read_paste(&line, &pos);
+					history_pos = -1;
+					redraw = true;
 				}
 				break;
 			default:
 				break;
 			}
+		} else if (c == '\022') { // Ctrl-R
+			history_pos = -1;
+			if (search_history(&line, &pos, &cursor_row)) {
+				pos = line.len;
+				reprint_buffer(&line, &cursor_row, pos);
+				break; // submit the match
+			}
+			redraw = true;
 		} else if (c == '\177') { // backspace
 			if (pos > 0) {
-				memmove(&buffer[pos - 1], &buffer[pos],
-						strlen(&buffer[pos]) + 1);
-				pos--;
+				line_delete(&line, --pos);
 				// if modifying text reset history
 				history_pos = -1;
-				reprint_buffer(buffer, &last_lines, &pos, history_pos);
+				redraw = true;
 			}
 		} else if (c == '\n') {
 			// if modifying text reset history
 			history_pos = -1;
-			pos = strlen(buffer);
-			reprint_buffer(buffer, &last_lines, &pos, history_pos);
+			pos = line.len;
+			reprint_buffer(&line, &cursor_row, pos);
 			break; // submit the command
-		} else {
-			if (pos < BUFFER_SIZE - 1) {
-				// insert text into buffer
-				memmove(&buffer[pos + 1], &buffer[pos],
-						strlen(&buffer[pos]) + 1);
-				buffer[pos] = c;
-				pos++;
-				// handle edge case where cursor should be moved down
-				int width = get_terminal_width();
-				char *prompt = get_prompt();
-				if ((strlen(prompt) + pos) % width == width - 1 &&
-					pos < strlen(buffer)) {
-					printf("\033[B");
-				}
-				// if modifying text reset history
-				history_pos = -1;
-				reprint_buffer(buffer, &last_lines, &pos, history_pos);
-			}
+		} else {
+			// insert text into buffer
+			char ch = c;
+			line_insert(&line, pos, &ch, 1);
+			pos++;
+			// if modifying text reset history
+			history_pos = -1;
+			redraw = true;
 		}
 	}
 
+	free(history_prefix);
+	output_append_str("\033[?2004l");
+	output_flush();
 	reset_terminal_mode(&orig_termios);
-	return buffer;
+	return line.data;
 }
 
-char **lush_split_pipes(char *line) {
-	char **commands = calloc(16, sizeof(char *));
-	if (!commands) {
-		perror("calloc failed");
-		exit(1);
+bool lush_split_background(char *line) {
+	// a trailing & runs the line as a background job
+	char *end = line + strlen(line);
+	while (end > line && (end[-1] == ' ' || end[-1] == '\n'))
+		end--;
+	if (end == line || end[-1] != '&')
+		return false;
+	end[-1] = '\0';
+	return true;
+}
+
+static char *substitution_end(const char *inner) {
+	// the ) closing a $( whose command starts at inner, NULL if it is never
+	// closed. nested parentheses and quoted text are skipped over
+	int depth = 1;
+	bool quoted = false;
+	for (const char *c = inner; *c; c++) {
+		if (*c == '"')
+			quoted = !quoted;
+		else if (quoted)
+			continue;
+		else if (*c == '(')
+			depth++;
+		else if (*c == ')' && --depth == 0)
+			return (char *)c;
+	}
+	return NULL;
+}
+
+char **lush_split_pipes(lush_arena_t *arena, char *line) {
+	// every | can start another command, except the ones of a substituted
+	// $(...) command which runs a pipeline of its own
+	int max_commands = 1;
+	for (char *c = line; *c; c++) {
+		if (*c == '|')
+			max_commands++;
 	}
+	char **commands = lush_arena_calloc(arena, max_commands + 1, sizeof(char *));
 
-	char *command;
+	char *command = line;
 	int pos = 0;
-
-	command = strtok(line, "|");
-	while (command) {
-		commands[pos++] = command;
-		command = strtok(NULL, "|");
+	for (char *c = line;; c++) {
+		char *end;
+		if (c[0] == '$' && c[1] == '(' && (end = substitution_end(c + 2))) {
+			c = end;
+			continue;
+		}
+		if (*c != '|' && *c != '\0')
+			continue;
+		bool last = *c == '\0';
+		*c = '\0';
+		// empty commands between two |s are skipped
+		if (c > command)
+			commands[pos++] = command;
+		if (last)
+			break;
+		command = c + 1;
 	}
 
 	// trim off whitespace
@@ -386,21 +1326,107 @@ char **lush_split_pipes(char *line) {
 	return commands;
 }
 
-char ***lush_split_args(char **commands, int *status) {
-	int outer_pos = 0;
-	char ***command_args = calloc(128, sizeof(char **));
-	if (!command_args) {
-		perror("calloc failed");
-		exit(1);
+static char *parse_redirect(char *arg, lush_redirect_t *redirect) {
+	// fills in the operator at the start of arg and returns what follows
+	// it, NULL if arg is not a redirection
+	char *rest = arg;
+	redirect->fd = STDOUT_FILENO;
+	redirect->dup = -1;
+	redirect->target = NULL;
+	redirect->is_var = false;
+	if (*rest == '<') {
+		redirect->fd = STDIN_FILENO;
+		redirect->flags = O_RDONLY;
+		return rest + 1;
 	}
+	if (*rest == '2') {
+		redirect->fd = STDERR_FILENO;
+		rest++;
+	}
+	if (*rest != '>')
+		return NULL;
+	rest++;
+	if (*rest == '>') {
+		redirect->flags = O_WRONLY | O_CREAT | O_APPEND;
+		return rest + 1;
+	}
+	if (redirect->fd == STDERR_FILENO && strcmp(rest, "&1") == 0) {
+		redirect->dup = STDOUT_FILENO;
+		return rest + 2;
+	}
+	redirect->flags = O_WRONLY | O_CREAT | O_TRUNC;
+	return rest;
+}
+
+static lush_redirect_t *split_redirects(lush_arena_t *arena, char **args,
+										bool *is_var, bool *is_glob,
+										const bool *quoted) {
+	// move redirections out of args, quoted operators stay, args that are
+	// kept get marked if they hold variables or patterns to expand per run
+	int num_args = 0;
+	while (args[num_args])
+		num_args++;
+	lush_redirect_t *redirects =
+		lush_arena_alloc(arena, (num_args + 1) * sizeof(lush_redirect_t));
+
+	int num_redirects = 0;
+	int kept = 0;
+	for (int k = 0; k < num_args; k++) {
+		lush_redirect_t *redirect = &redirects[num_redirects];
+		char *rest;
+		if (quoted[k] || (rest = parse_redirect(args[k], redirect)) == NULL) {
+			bool has_var = !quoted[k] && strchr(args[k], '$');
+			args[kept] = args[k];
+			is_glob[kept] = !quoted[k] && !has_var && lush_has_glob(args[k]);
+			is_var[kept++] = has_var;
+			continue;
+		}
+		num_redirects++;
+		if (redirect->dup != -1) {
+			continue;
+		} else if (*rest) {
+			redirect->target = rest;
+			redirect->is_var = strchr(rest, '$') != NULL;
+		} else if (k + 1 < num_args) {
+			// a missing target is reported once the command runs
+			redirect->target = args[++k];
+			redirect->is_var = !quoted[k] && strchr(args[k], '$');
+		}
+	}
+	args[kept] = NULL;
+	redirects[num_redirects].fd = -1;
+	return redirects;
+}
+
+static char ***tokenize_commands(lush_arena_t *arena, char **commands,
+								 bool ***vars, bool ***globs,
+								 lush_redirect_t ***redirects, int *status) {
+	int outer_pos = 0;
+	int num_commands = 0;
+	while (commands[num_commands])
+		num_commands++;
+	char ***command_args =
+		lush_arena_calloc(arena, num_commands + 1, sizeof(char **));
+	bool **command_vars =
+		lush_arena_calloc(arena, num_commands + 1, sizeof(bool *));
+	bool **command_globs =
+		lush_arena_calloc(arena, num_commands + 1, sizeof(bool *));
+	lush_redirect_t **command_redirects =
+		lush_arena_calloc(arena, num_commands + 1, sizeof(lush_redirect_t *));
+	*vars = command_vars;
+	*globs = command_globs;
+	*redirects = command_redirects;
 
 	for (int i = 0; commands[i]; i++) {
 		int pos = 0;
-		char **args = calloc(128, sizeof(char *));
-		if (!args) {
-			perror("calloc failed");
-			exit(1);
-		}
+		// args are separated by at least one character so this always fits
+		size_t max_args = strlen(commands[i]) / 2 + 2;
+		char **args = lush_arena_calloc(arena, max_args, sizeof(char *));
+		// marks args with $ variables to expand before running
+		bool *is_var = lush_arena_calloc(arena, max_args, sizeof(bool));
+		bool *is_glob = lush_arena_calloc(arena, max_args, sizeof(bool));
+		// quoted args are never taken for redirection operators
+		bool *quoted = lush_arena_calloc(arena, max_args, sizeof(bool));
 
 		bool inside_string = false;
 		char *current_token = &commands[i][0];
@@ -420,6 +1446,7 @@ char ***lush_split_args(char **commands, int *status) {
 					// ending of a string
 					inside_string = false;
 					commands[i][j] = '\0';
+					quoted[pos] = true;
 					args[pos++] = current_token;
 					current_token = NULL;
 				} else {
@@ -433,14 +1460,11 @@ char ***lush_split_args(char **commands, int *status) {
 				}
 				current_token = &commands[i][j + 1]; // go past the space
 				commands[i][j] = '\0';				 // null the space
-			} else if (commands[i][j] == '$' && commands[i][j + 1] &&
-					   commands[i][j + 1] != ' ') {
-				// environment variable
-				args[pos++] = getenv(&commands[i][++j]);
-				while (commands[i][j]) {
-					++j;
-				}
-				current_token = &commands[i][j + 1];
+			} else if (commands[i][j] == '$' && commands[i][j + 1] == '(') {
+				// a substituted command stays in one arg, spaces and all
+				char *end = substitution_end(&commands[i][j + 2]);
+				if (end)
+					j = end - commands[i];
 			} else {
 				// regular character
 				continue;
@@ -457,6 +1481,10 @@ char ***lush_split_args(char **commands, int *status) {
 		}
 
 		// add this commands args array to the outer array
+		command_redirects[outer_pos] =
+			split_redirects(arena, args, is_var, is_glob, quoted);
+		command_vars[outer_pos] = is_var;
+		command_globs[outer_pos] = is_glob;
 		command_args[outer_pos++] = args;
 	}
 
@@ -464,113 +1492,963 @@ char ***lush_split_args(char **commands, int *status) {
 	return command_args;
 }
 
-int lush_execute_pipeline(char ***commands, int num_commands) {
-	// no command given
-	if (commands[0][0][0] == '\0') {
+// output of every $(...) in a line, used up in the order they appear
+typedef struct {
+	char **outputs;
+	size_t count;
+	size_t next;
+} substitutions_t;
+
+static size_t var_name_length(const char *name) {
+	size_t len = 0;
+	if (name[0] >= '0' && name[0] <= '9')
+		return 0;
+	while (name[len] == '_' || isalnum((unsigned char)name[len]))
+		len++;
+	return len;
+}
+
+static size_t expand_vars(const char *word, char *out, bool *only_vars,
+						  substitutions_t *subs) {
+	// writes word with $NAME, ${NAME} and $(...) replaced into out if it is
+	// not NULL and returns the expanded length, unset variables expand to
+	// nothing and a $ that starts no name is kept as it is
+	size_t len = 0;
+	char name[256];
+	*only_vars = true;
+	for (const char *c = word; *c;) {
+		const char *value = NULL;
+		const char *end;
+		if (c[0] == '$' && c[1] == '(' && (end = substitution_end(c + 2))) {
+			if (subs && subs->next < subs->count)
+				value = subs->outputs[subs->next++];
+			c = end + 1;
+		} else {
+			bool braced = c[0] == '$' && c[1] == '{';
+			const char *start = c + (braced ? 2 : 1);
+			size_t name_len = c[0] == '$' ? var_name_length(start) : 0;
+			if (name_len == 0 || name_len >= sizeof(name) ||
+				(braced && start[name_len] != '}')) {
+				if (out)
+					out[len] = *c;
+				len++;
+				c++;
+				*only_vars = false;
+				continue;
+			}
+			memcpy(name, start, name_len);
+			name[name_len] = '\0';
+			value = lush_var_get(name);
+			c = start + name_len + braced;
+		}
+		size_t value_len = value ? strlen(value) : 0;
+		if (out && value)
+			memcpy(out + len, value, value_len);
+		len += value_len;
+	}
+	if (out)
+		out[len] = '\0';
+	return len;
+}
+
+static char *expand_arg(lush_arena_t *arena, char *arg, bool is_var,
+						substitutions_t *subs, bool *split) {
+	// NULL when arg was nothing but unset or empty variables so it can be
+	// left out the way other shells drop empty unquoted expansions, split
+	// is set if command output went into it
+	*split = false;
+	if (!is_var)
+		return arg;
+	// a lone $(...) is its output, which already sits in the arena
+	if (arg[0] == '$' && arg[1] == '(' &&
+		substitution_end(arg + 2) == arg + strlen(arg) - 1 &&
+		subs->next < subs->count) {
+		*split = true;
+		return subs->outputs[subs->next++];
+	}
+	substitutions_t measured = *subs;
+	bool only_vars;
+	size_t len = expand_vars(arg, NULL, &only_vars, &measured);
+	*split = measured.next != subs->next;
+	if (len == 0 && only_vars) {
+		*subs = measured;
+		return NULL;
+	}
+	char *expanded = lush_arena_alloc(arena, len + 1);
+	expand_vars(arg, expanded, &only_vars, subs);
+	return expanded;
+}
+
+static size_t split_words(char *str, char **words) {
+	// count the whitespace separated words of str, if words is given they
+	// are cut apart in place and stored in it
+	size_t count = 0;
+	char *c = str;
+	while (*c) {
+		while (*c == ' ' || *c == '\t' || *c == '\n')
+			c++;
+		if (*c == '\0')
+			break;
+		if (words)
+			words[count] = c;
+		count++;
+		while (*c && *c != ' ' && *c != '\t' && *c != '\n')
+			c++;
+		if (*c && words)
+			*c++ = '\0';
+		else if (*c)
+			c++;
+	}
+	return count;
+}
+
+static int compile_commands(lush_arena_t *arena, char **commands,
+							lush_cmdline_t *cmdline) {
+	int status = 0;
+	cmdline->args = tokenize_commands(arena, commands, &cmdline->vars,
+									  &cmdline->globs, &cmdline->redirects,
+									  &status);
+	cmdline->num_commands = status;
+	if (status != -1) {
+		// count args once so every run can size its copy directly
+		cmdline->num_args = lush_arena_alloc(arena, status * sizeof(int));
+		for (int i = 0; i < status; i++) {
+			int num_args = 0;
+			while (cmdline->args[i][num_args])
+				num_args++;
+			cmdline->num_args[i] = num_args;
+		}
+	}
+	return status;
+}
+
+char ***lush_split_args(lush_arena_t *arena, char **commands,
+						lush_redirect_t ***redirects, int *status) {
+	uint64_t trace_start = lush_trace_begin();
+	lush_cmdline_t cmdline;
+	*status = compile_commands(arena, commands, &cmdline);
+	*redirects = cmdline.redirects;
+	char ***args = cmdline.args;
+	if (*status != -1)
+		args = lush_expand_line(arena, &cmdline);
+	lush_trace_span("parse", trace_start, NULL);
+	return args;
+}
+
+int lush_compile_line(lush_arena_t *arena, const char *line,
+					  lush_cmdline_t *cmdline) {
+	// the parser writes into the line so the arena keeps its own copy
+	char *line_copy = lush_arena_strdup(arena, line);
+	cmdline->background = lush_split_background(line_copy);
+	char **commands = lush_split_pipes(arena, line_copy);
+	uint64_t trace_start = lush_trace_begin();
+	int status = compile_commands(arena, commands, cmdline);
+	lush_trace_span("compile", trace_start, line);
+	return status;
+}
+
+// -- command substitution --
+
+// first read buffer of a substituted command, most outputs fit in it
+#define SUBSTITUTION_BUFFER 4096
+
+typedef struct {
+	lush_job_t job;
+	// read end of the command's stdout, -1 once it hit EOF
+	int fd;
+	char *output;
+	size_t len;
+	size_t cap;
+} substitution_t;
+
+static size_t count_substitutions(const char *word) {
+	size_t count = 0;
+	for (const char *c = word; *c; c++) {
+		const char *end;
+		if (c[0] == '$' && c[1] == '(' && (end = substitution_end(c + 2))) {
+			count++;
+			c = end;
+		}
+	}
+	return count;
+}
+
+static void start_substitution(lush_arena_t *arena, substitution_t *sub,
+							   const char *command, size_t len) {
+	// the command is parsed like any other line, so its own $(...) already
+	// ran by the time this one starts
+	sub->fd = -1;
+	char *line = lush_arena_strndup(arena, command, len);
+	char **commands = lush_split_pipes(arena, line);
+	lush_redirect_t **redirects;
+	int status = 0;
+	char ***args = lush_split_args(arena, commands, &redirects, &status);
+	if (status == -1) {
+		fprintf(stderr, "lush: Expected end of quoted string\n");
+		return;
+	}
+	if (status == 0 || args[0][0] == NULL || args[0][0][0] == '\0')
+		return;
+
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC) == -1) {
+		perror("pipe");
+		return;
+	}
+	if (lush_start_pipeline(&sub->job, args, redirects, status, STDIN_FILENO,
+							fds[1], STDERR_FILENO, false) == 0) {
+		sub->fd = fds[0];
+	} else {
+		close(fds[0]);
+	}
+	close(fds[1]);
+}
+
+static void read_substitution(lush_arena_t *arena, substitution_t *sub) {
+	// read straight into arena memory, a full buffer is replaced by one
+	// twice its size
+	if (sub->cap - sub->len < 2) {
+		size_t cap = sub->cap ? sub->cap * 2 : SUBSTITUTION_BUFFER;
+		char *output = lush_arena_alloc(arena, cap);
+		if (sub->len)
+			memcpy(output, sub->output, sub->len);
+		sub->output = output;
+		sub->cap = cap;
+	}
+	// one byte is kept back for the terminator
+	ssize_t n = read(sub->fd, sub->output + sub->len, sub->cap - sub->len - 1);
+	if (n > 0) {
+		sub->len += n;
+	} else if (n == 0 || errno != EINTR) {
+		close(sub->fd);
+		sub->fd = -1;
+	}
+}
+
+static substitutions_t run_substitutions(lush_arena_t *arena,
+										 const lush_cmdline_t *cmdline) {
+	// every $(...) of the line is started before any output is read so
+	// independent commands run at the same time
+	substitutions_t result = {NULL, 0, 0};
+	for (int i = 0; i < cmdline->num_commands; i++) {
+		for (int j = 0; j < cmdline->num_args[i]; j++) {
+			if (cmdline->vars[i][j])
+				result.count += count_substitutions(cmdline->args[i][j]);
+		}
+	}
+	if (result.count == 0)
+		return result;
+
+	uint64_t trace_start = lush_trace_begin();
+	substitution_t *subs =
+		lush_arena_calloc(arena, result.count, sizeof(substitution_t));
+	size_t started = 0;
+	for (int i = 0; i < cmdline->num_commands; i++) {
+		for (int j = 0; j < cmdline->num_args[i]; j++) {
+			if (!cmdline->vars[i][j])
+				continue;
+			for (const char *c = cmdline->args[i][j]; *c; c++) {
+				const char *end;
+				if (c[0] == '$' && c[1] == '(' &&
+					(end = substitution_end(c + 2))) {
+					start_substitution(arena, &subs[started++], c + 2,
+									   end - (c + 2));
+					c = end;
+				}
+			}
+		}
+	}
+
+	// poll skips the entries whose fd is already -1
+	struct pollfd *fds =
+		lush_arena_alloc(arena, result.count * sizeof(struct pollfd));
+	size_t open_fds = result.count;
+	while (open_fds > 0) {
+		open_fds = 0;
+		for (size_t k = 0; k < result.count; k++) {
+			fds[k].fd = subs[k].fd;
+			fds[k].events = POLLIN;
+			fds[k].revents = 0;
+			open_fds += subs[k].fd != -1;
+		}
+		if (open_fds == 0)
+			break;
+		if (poll(fds, result.count, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+		for (size_t k = 0; k < result.count; k++) {
+			if (fds[k].revents)
+				read_substitution(arena, &subs[k]);
+		}
+	}
+
+	result.outputs = lush_arena_alloc(arena, result.count * sizeof(char *));
+	for (size_t k = 0; k < result.count; k++) {
+		substitution_t *sub = &subs[k];
+		if (sub->fd != -1)
+			close(sub->fd);
+		if (sub->job.pids) {
+			lush_wait_pipeline(&sub->job);
+			lush_free_job(&sub->job);
+		}
+		// trailing newlines are dropped like in other shells
+		while (sub->len > 0 && sub->output[sub->len - 1] == '\n')
+			sub->len--;
+		if (sub->output)
+			sub->output[sub->len] = '\0';
+		result.outputs[k] = sub->output ? sub->output : "";
+	}
+	lush_trace_span("substitute", trace_start, NULL);
+	return result;
+}
+
+char ***lush_expand_line(lush_arena_t *arena, const lush_cmdline_t *cmdline) {
+	// the compiled line is never written to, each run gets fresh arrays,
+	// directories listed for one pattern are reused by the rest of the line
+	uint64_t trace_start = lush_trace_begin();
+	substitutions_t subs = run_substitutions(arena, cmdline);
+	lush_glob_cache_t cache;
+	lush_glob_cache_init(&cache);
+	lush_glob_result_t matches = {0};
+	char ***command_args =
+		lush_arena_alloc(arena, (cmdline->num_commands + 1) * sizeof(char **));
+	for (int i = 0; i < cmdline->num_commands; i++) {
+		int num_args = cmdline->num_args[i];
+		// how many args each one turns into, patterns without a match are
+		// passed on as they were written and command output is split into
+		// words, words is NULL where variables expanded to nothing
+		size_t *counts = lush_arena_calloc(arena, num_args, sizeof(size_t));
+		char **words = lush_arena_alloc(arena, num_args * sizeof(char *));
+		bool *split = lush_arena_calloc(arena, num_args, sizeof(bool));
+		size_t total = 0;
+		for (int j = 0; j < num_args; j++) {
+			words[j] = cmdline->args[i][j];
+			if (cmdline->globs[i][j]) {
+				counts[j] = lush_glob(&cache, words[j], &matches);
+			} else {
+				words[j] = expand_arg(arena, words[j], cmdline->vars[i][j],
+									  &subs, &split[j]);
+				if (words[j] && split[j])
+					counts[j] = split_words(words[j], NULL);
+			}
+			total += counts[j] ? counts[j] : 1;
+		}
+
+		char **args = lush_arena_alloc(arena, (total + 1) * sizeof(char *));
+		size_t pos = 0;
+		size_t match = 0;
+		for (int j = 0; j < num_args; j++) {
+			if (cmdline->globs[i][j] && counts[j]) {
+				for (size_t k = 0; k < counts[j]; k++)
+					args[pos++] =
+						lush_arena_strdup(arena, matches.paths[match++]);
+			} else if (split[j] && words[j]) {
+				pos += split_words(words[j], args + pos);
+			} else if (words[j]) {
+				args[pos++] = words[j];
+			}
+		}
+		// a command made only of empty variables still needs a name so
+		// the pipeline keeps its shape
+		if (pos == 0 && num_args > 0)
+			args[pos++] = "";
+		args[pos] = NULL;
+		command_args[i] = args;
+		lush_glob_result_free(&matches);
+	}
+	command_args[cmdline->num_commands] = NULL;
+	lush_glob_cache_free(&cache);
+	lush_trace_span("expand", trace_start, NULL);
+	return command_args;
+}
+
+static int open_redirect(const lush_redirect_t *redirect) {
+	char *target = redirect->target;
+	bool only_vars = false;
+	if (target && redirect->is_var) {
+		size_t len = expand_vars(redirect->target, NULL, &only_vars, NULL);
+		target = malloc(len + 1);
+		if (target == NULL) {
+			perror("malloc");
+			return -1;
+		}
+		expand_vars(redirect->target, target, &only_vars, NULL);
+	}
+	int fd = -1;
+	if (target == NULL || (*target == '\0' && only_vars)) {
+		fprintf(stderr, "lush: missing file for redirection\n");
+	} else if ((fd = open(target, redirect->flags | O_CLOEXEC, 0666)) == -1) {
+		fprintf(stderr, "lush: %s: %s\n", target, strerror(errno));
+	}
+	if (target != redirect->target)
+		free(target);
+	return fd;
+}
+
+static void release_redirect(const int defaults[3], int fds[3], int slot) {
+	// files we opened are closed once no other slot still uses them
+	int fd = fds[slot];
+	for (int k = 0; k < 3; k++) {
+		if (defaults[k] == fd || (k != slot && fds[k] == fd))
+			return;
+	}
+	close(fd);
+}
+
+static void close_redirects(const int defaults[3], int fds[3]) {
+	for (int k = 0; k < 3; k++) {
+		release_redirect(defaults, fds, k);
+		fds[k] = defaults[k];
+	}
+}
+
+static bool apply_redirects(const lush_redirect_t *redirects,
+							const int defaults[3], int fds[3]) {
+	// files are opened here in the parent and handed to the child as its
+	// stdin, stdout or stderr directly, so no stage has to copy them
+	for (int k = 0; k < 3; k++)
+		fds[k] = defaults[k];
+	for (const lush_redirect_t *redirect = redirects;
+		 redirect && redirect->fd != -1; redirect++) {
+		int fd = redirect->dup != -1 ? fds[redirect->dup]
+									 : open_redirect(redirect);
+		if (fd == -1) {
+			close_redirects(defaults, fds);
+			return false;
+		}
+		int previous = fds[redirect->fd];
+		fds[redirect->fd] = fd;
+		if (previous != fd) {
+			int replaced[3] = {fds[0], fds[1], fds[2]};
+			replaced[redirect->fd] = previous;
+			release_redirect(defaults, replaced, redirect->fd);
+		}
+	}
+	return true;
+}
+
+static int run_redirected(lua_State *L, int (*func)(lua_State *, char ***),
+						  char ***commands, const lush_redirect_t *redirects) {
+	// builtins and scripts run in the shell itself, so its own fds are
+	// swapped out while they run
+	if (redirects == NULL || redirects->fd == -1)
+		return func(L, commands);
+
+	const int defaults[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+	int fds[3];
+	if (!apply_redirects(redirects, defaults, fds))
 		return 1;
+
+	fflush(stdout);
+	int saved[3] = {-1, -1, -1};
+	// stderr first so 2>&1 >file still copies the old stdout
+	for (int k = 2; k >= 0; k--) {
+		if (fds[k] == k)
+			continue;
+		saved[k] = fcntl(k, F_DUPFD_CLOEXEC, 10);
+		dup2(fds[k], k);
+	}
+	close_redirects(defaults, fds);
+
+	int rc = func(L, commands);
+
+	fflush(stdout);
+	fflush(stderr);
+	for (int k = 0; k < 3; k++) {
+		if (saved[k] != -1) {
+			dup2(saved[k], k);
+			close(saved[k]);
+		}
 	}
+	return rc;
+}
+
+// exit status of every stage of the last pipeline, like bash's PIPESTATUS
+static int *pipestatus = NULL;
+static int pipestatus_len = 0;
+
+const int *lush_get_pipestatus(int *num_stages) {
+	*num_stages = pipestatus_len;
+	return pipestatus;
+}
+
+void lush_set_pipestatus(const int *statuses, int num_stages) {
+	int *copy = realloc(pipestatus, num_stages * sizeof(int));
+	if (copy == NULL) {
+		perror("realloc");
+		return;
+	}
+	memcpy(copy, statuses, num_stages * sizeof(int));
+	pipestatus = copy;
+	pipestatus_len = num_stages;
+}
+
+static bool decode_status(int raw_status, int *status) {
+	// exit code, or 128 plus the signal like other shells report it
+	if (WIFEXITED(raw_status)) {
+		*status = WEXITSTATUS(raw_status);
+		return true;
+	}
+	if (WIFSIGNALED(raw_status)) {
+		*status = 128 + WTERMSIG(raw_status);
+		return true;
+	}
+	return false;
+}
+
+static int wait_for_child(pid_t pid) {
+	int raw_status, status;
+	while (true) {
+		if (waitpid(pid, &raw_status, WUNTRACED) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("waitpid");
+			return -1;
+		}
+		if (decode_status(raw_status, &status)) {
+			lush_stat_child_reaped(pid);
+			lush_trace_process_exit(pid, status);
+			return status;
+		}
+		// only jobs from the job table can be stopped and resumed later,
+		// anything else would leave its caller waiting forever
+		if (WIFSTOPPED(raw_status))
+			kill(pid, SIGCONT);
+	}
+}
+
+int lush_try_wait(pid_t pid, int *status) {
+	int raw_status;
+	pid_t rc;
+	do {
+		rc = waitpid(pid, &raw_status, WNOHANG);
+	} while (rc == -1 && errno == EINTR);
+
+	if (rc == -1) {
+		*status = -1;
+		return -1;
+	}
+	if (rc == 0)
+		return 0;
+	if (!decode_status(raw_status, status))
+		return 0;
+	lush_stat_child_reaped(pid);
+	lush_trace_process_exit(pid, *status);
+	return 1;
+}
+
+int lush_start_pipeline(lush_job_t *job, char ***commands,
+						lush_redirect_t **redirects, int num_commands,
+						int input_fd, int output_fd, int error_fd,
+						bool own_group) {
+	job->num_commands = num_commands;
+	job->pgid = 0;
+	job->pids = malloc(num_commands * sizeof(pid_t));
+	job->statuses = malloc(num_commands * sizeof(int));
+	if (!job->pids || !job->statuses) {
+		perror("malloc");
+		lush_free_job(job);
+		return -1;
+	}
+	for (int i = 0; i < num_commands; i++) {
+		job->pids[i] = -1;
+		job->statuses[i] = 127; // the stage could not be started
+	}
+
+	// start every stage before waiting on any of them so that all stages
+	// run concurrently and a full pipe never blocks a writer forever
+	int stage_input = input_fd;
+	for (int i = 0; i < num_commands; i++) {
+		int pipe_fds[2] = {-1, -1};
+		int stage_output = output_fd;
+		if (i < num_commands - 1) {
+			// close on exec so no stage inherits pipe ends it does not use
+			if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+				perror("pipe");
+				break;
+			}
+			stage_output = pipe_fds[1];
+		}
 
-	// create pipes for each command
-	int **pipes = malloc((num_commands - 1) * sizeof(int *));
-	for (int i = 0; i < num_commands - 1; i++) {
-		pipes[i] =
-			malloc(2 * sizeof(int)); // pipes[i][0] = in, pipes[i][1] = out
-		if (pipe(pipes[i]) == -1) {
-			perror("pipe");
-			return 0;
+		// the first stage that starts leads the process group
+		pid_t pgid = own_group ? job->pgid : -1;
+		const int defaults[3] = {stage_input, stage_output, error_fd};
+		int fds[3];
+		if (apply_redirects(redirects ? redirects[i] : NULL, defaults, fds)) {
+			job->pids[i] =
+				lush_execute_command(commands[i], fds[0], fds[1], fds[2], pgid);
+			close_redirects(defaults, fds);
+		} else {
+			job->statuses[i] = 1;
 		}
+		if (own_group && job->pids[i] > 0) {
+			if (job->pgid == 0)
+				job->pgid = job->pids[i];
+			// also done here in case the child has not got to it yet
+			setpgid(job->pids[i], job->pgid);
+		}
+
+		// the parent must not hold any pipe ends or readers never see EOF,
+		// the fds passed in belong to the caller
+		if (stage_input != input_fd)
+			close(stage_input);
+		if (stage_output != output_fd)
+			close(stage_output);
+		stage_input = pipe_fds[0];
 	}
+	if (stage_input != input_fd && stage_input != -1)
+		close(stage_input);
 
-	// execute commands in the pipeline
-	for (int i = 0; i < num_commands - 1; i++) {
-		int input_fd = (i == 0) ? STDIN_FILENO : pipes[i - 1][0];
-		int output_fd = pipes[i][1];
+	return 0;
+}
 
-		lush_execute_command(commands[i], input_fd, output_fd);
-		close(output_fd); // no longer need to write to this pipe
+void lush_wait_pipeline(lush_job_t *job) {
+	// reap the whole pipeline
+	for (int i = 0; i < job->num_commands; i++) {
+		if (job->pids[i] > 0)
+			job->statuses[i] = wait_for_child(job->pids[i]);
 	}
 
-	// execute last or only command
-	int input_fd =
-		(num_commands > 1) ? pipes[num_commands - 2][0] : STDIN_FILENO;
-	int output_fd = STDOUT_FILENO;
-	lush_execute_command(commands[num_commands - 1], input_fd, output_fd);
+	lush_set_pipestatus(job->statuses, job->num_commands);
+}
+
+void lush_free_job(lush_job_t *job) {
+	free(job->pids);
+	free(job->statuses);
+	job->pids = NULL;
+	job->statuses = NULL;
+}
+
+int lush_execute_pipeline(char ***commands, lush_redirect_t **redirects,
+						  int num_commands, bool background) {
+	// no command given
+	if (commands[0][0][0] == '\0') {
+		return 1;
+	}
 
-	// close pipes
-	for (int i = 0; i < num_commands - 1; i++) {
-		close(pipes[i][0]);
-		close(pipes[i][1]);
-		free(pipes[i]);
+	lush_job_t job;
+	if (lush_start_pipeline(&job, commands, redirects, num_commands,
+							STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO,
+							lush_jobs_enabled()) == 0) {
+		if (background) {
+			lush_jobs_background(&job, commands);
+		} else {
+			uint64_t trace_start = lush_trace_begin();
+			lush_jobs_foreground(&job, commands);
+			lush_trace_span("wait", trace_start, commands[0][0]);
+		}
 	}
-	free(pipes);
 	return 1;
 }
 
-void lush_execute_command(char **args, int input_fd, int output_fd) {
+static bool is_exec_error(int error) {
+	// errors about the program itself, forking would fail the same way
+	return error == ENOENT || error == EACCES || error == ENOTDIR ||
+		   error == ELOOP || error == ENAMETOOLONG || error == ETXTBSY;
+}
+
+static pid_t spawn_command(const char *path, char **args, int input_fd,
+						   int output_fd, int error_fd, pid_t pgid,
+						   int *error) {
+	// posix_spawn uses vfork semantics, so nothing is copied from the
+	// parent no matter how large the Lua heap has grown
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	pid_t pid = -1;
+
+	*error = posix_spawn_file_actions_init(&actions);
+	if (*error != 0)
+		return -1;
+	*error = posix_spawnattr_init(&attr);
+	if (*error != 0) {
+		posix_spawn_file_actions_destroy(&actions);
+		return -1;
+	}
+
+	// redirect in and out fd's if needed, stderr goes first so that
+	// 2>&1 >file still gets the stdout from before the redirection
+	if (error_fd != STDERR_FILENO)
+		posix_spawn_file_actions_adddup2(&actions, error_fd, STDERR_FILENO);
+	if (input_fd != STDIN_FILENO)
+		posix_spawn_file_actions_adddup2(&actions, input_fd, STDIN_FILENO);
+	if (output_fd != STDOUT_FILENO)
+		posix_spawn_file_actions_adddup2(&actions, output_fd, STDOUT_FILENO);
+
+	// restore the signals the shell ignores and start with none blocked
+	sigset_t default_signals, mask;
+	sigemptyset(&default_signals);
+	sigaddset(&default_signals, SIGINT);
+	sigaddset(&default_signals, SIGTSTP);
+	sigaddset(&default_signals, SIGTTIN);
+	sigaddset(&default_signals, SIGTTOU);
+	sigemptyset(&mask);
+	posix_spawnattr_setsigdefault(&attr, &default_signals);
+	posix_spawnattr_setsigmask(&attr, &mask);
+	short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+	if (pgid >= 0) {
+		posix_spawnattr_setpgroup(&attr, pgid);
+		flags |= POSIX_SPAWN_SETPGROUP;
+	}
+	posix_spawnattr_setflags(&attr, flags);
+
+	*error = posix_spawn(&pid, path, &actions, &attr, args, lush_var_envp());
+	if (*error != 0)
+		pid = -1;
+
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+	return pid;
+}
+
+static void exec_script_r(const char *path, char **args) {
+	// run files without a shebang through sh the way execvp does
+	int argc = 0;
+	while (args[argc])
+		argc++;
+	char **sh_args = malloc((argc + 2) * sizeof(char *));
+	if (sh_args == NULL)
+		return;
+	sh_args[0] = "sh";
+	sh_args[1] = (char *)path;
+	for (int i = 1; i <= argc; i++)
+		sh_args[i + 1] = args[i];
+	execve("/bin/sh", sh_args, lush_var_envp());
+	free(sh_args);
+}
+
+pid_t lush_fork_stage(int input_fd, int output_fd, int error_fd, pid_t pgid) {
 	// create child
 	pid_t pid;
-	int status;
-
-	struct sigaction sa;
 
 	if ((pid = fork()) == 0) {
 		// child process content
 
-		// restore default sigint for child
+		if (pgid >= 0)
+			setpgid(0, pgid);
+
+		// restore the signals the shell ignores or handles
+		struct sigaction sa;
 		sa.sa_handler = SIG_DFL;
+		sa.sa_flags = 0;
+		sigemptyset(&sa.sa_mask);
 		sigaction(SIGINT, &sa, NULL);
-
-		// redirect in and out fd's if needed
-		if (input_fd != STDIN_FILENO) {
+		sigaction(SIGTSTP, &sa, NULL);
+		sigaction(SIGTTIN, &sa, NULL);
+		sigaction(SIGTTOU, &sa, NULL);
+		sigaction(SIGCHLD, &sa, NULL);
+
+		// redirect in and out fd's if needed, the originals are all close
+		// on exec and one file can back both stdout and stderr
+		if (error_fd != STDERR_FILENO)
+			dup2(error_fd, STDERR_FILENO);
+		if (input_fd != STDIN_FILENO)
 			dup2(input_fd, STDIN_FILENO);
-			close(input_fd);
-		}
-
-		if (output_fd != STDOUT_FILENO) {
+		if (output_fd != STDOUT_FILENO)
 			dup2(output_fd, STDOUT_FILENO);
-			close(output_fd);
-		}
-
-		// execute the command
-		if (execvp(args[0], args) == -1) {
-			perror("execvp");
-			exit(EXIT_FAILURE);
-		}
 	} else if (pid < 0) {
 		// forking failed
 		perror("fork");
+	}
+
+	return pid;
+}
+
+static pid_t fork_command(const char *path, char **args, int input_fd,
+						  int output_fd, int error_fd, pid_t pgid) {
+	pid_t pid = lush_fork_stage(input_fd, output_fd, error_fd, pgid);
+	if (pid == 0) {
+		// execute the command
+		execve(path, args, lush_var_envp());
+		if (errno == ENOEXEC)
+			exec_script_r(path, args);
+		perror("execv");
 		exit(EXIT_FAILURE);
-	} else {
-		// parent process
-		do {
-			waitpid(pid, &status, WUNTRACED);
-		} while (!WIFEXITED(status) && !WIFSIGNALED(status));
 	}
+	return pid;
 }
 
-int lush_run(lua_State *L, char ***commands, int num_commands) {
+static pid_t start_command(char **args, int input_fd, int output_fd,
+							int error_fd, pid_t pgid) {
+	// lua:name stages run a Lua function in a fork of the shell
+	if (strncmp(args[0], LUA_STAGE_PREFIX, strlen(LUA_STAGE_PREFIX)) == 0)
+		return lua_spawn_filter(args, input_fd, output_fd, error_fd, pgid);
+
+	// resolve in the parent so the search is cached across commands
+	const char *path = lush_path_lookup(args[0]);
+	if (path == NULL) {
+		fprintf(stderr, "lush: command not found: %s\n", args[0]);
+		lush_stat_add(LUSH_STAT_EXEC_FAILURES, 1);
+		return -1;
+	}
+
+	// the helper forks from a small address space, posix_spawn takes over
+	// if it is off, went away or could not start this one command
+	int error = 0;
+	pid_t pid = -1;
+	if (lush_spawn_helper_running())
+		pid = lush_spawn_helper_spawn(path, args, lush_var_envp(), input_fd,
+									  output_fd, error_fd, pgid, &error);
+	if (pid == -1 && !is_exec_error(error) && error != ENOEXEC)
+		pid = spawn_command(path, args, input_fd, output_fd, error_fd, pgid,
+							&error);
+	if (pid > 0)
+		return pid;
+	if (is_exec_error(error)) {
+		fprintf(stderr, "lush: %s: %s\n", args[0], strerror(error));
+		lush_stat_add(LUSH_STAT_EXEC_FAILURES, 1);
+		return -1;
+	}
+
+	// fork is kept for whatever posix_spawn can not set up, such as
+	// scripts without a shebang line
+	// the caller waits once the whole pipeline has been started
+	return fork_command(path, args, input_fd, output_fd, error_fd, pgid);
+}
+
+pid_t lush_execute_command(char **args, int input_fd, int output_fd,
+						   int error_fd, pid_t pgid) {
+	// posix_spawn only returns once the child has exec'd, so the span
+	// covers fork and exec while the process event lasts until it is reaped
+	uint64_t trace_start = lush_trace_begin();
+	pid_t pid = start_command(args, input_fd, output_fd, error_fd, pgid);
+	lush_trace_span("spawn", trace_start, args[0]);
+	if (pid > 0) {
+		lush_stat_add(LUSH_STAT_FORKS, 1);
+		lush_stat_child_started(pid);
+		lush_trace_process_start(pid, trace_start, args[0]);
+	}
+	return pid;
+}
+
+int lush_run(lua_State *L, char ***commands, lush_redirect_t **redirects,
+			 int num_commands, bool background) {
 	if (commands[0][0] == NULL) {
 		// no command given
 		return 1;
 	}
+	lush_stat_add(LUSH_STAT_COMMANDS, 1);
+
+	if (num_commands == 1 && set_assignments(commands[0]))
+		return 1;
 
 	// check if the command is a lua script
 	char *ext = strchr(commands[0][0], '.');
 	if (ext) {
 		ext++;
 		if (strcmp(ext, "lua") == 0) {
-			return ((*builtin_func[4])(L, commands));
+			return run_redirected(L, lush_lua, commands,
+								  redirects ? redirects[0] : NULL);
 		}
 	}
 
 	// check shell builtins
-	for (int i = 0; i < lush_num_builtins(); i++) {
-		if (strcmp(commands[0][0], builtin_strs[i]) == 0) {
-			return ((*builtin_func[i])(L, commands));
+	lush_builtin_fn builtin = lush_find_builtin(commands[0][0]);
+	if (builtin == lush_time) {
+		// time starts the rest of the line itself, redirections included
+		time_redirects = redirects;
+		int rc = lush_time(L, commands);
+		time_redirects = NULL;
+		return rc;
+	}
+	if (builtin) {
+		return run_redirected(L, builtin, commands,
+							  redirects ? redirects[0] : NULL);
+	}
+
+	return lush_execute_pipeline(commands, redirects, num_commands,
+								 background);
+}
+
+// the benchmarks bring their own main and only need the shell's internals
+#ifndef LUSH_BENCH
+
+static bool run_line(lua_State *L, lush_arena_t *arena, char *line) {
+	// false once the exit builtin ran, the line is copied for the trace
+	// before parsing cuts it up
+	uint64_t trace_start = lush_trace_begin();
+	char *trace_line = trace_start ? lush_arena_strdup(arena, line) : NULL;
+	bool background = lush_split_background(line);
+	char **commands = lush_split_pipes(arena, line);
+	lush_redirect_t **redirects;
+	int status = 0;
+	char ***args = lush_split_args(arena, commands, &redirects, &status);
+	bool keep_going = true;
+	if (status == -1) {
+		fprintf(stderr, "lush: Expected end of quoted string\n");
+	} else if (lush_run(L, args, redirects, status, background) == 0) {
+		keep_going = false;
+	}
+	lush_trace_span("line", trace_start, trace_line);
+	lush_arena_reset(arena);
+	return keep_going;
+}
+
+// -- batch mode --
+
+static int last_status() {
+	int num_stages;
+	const int *statuses = lush_get_pipestatus(&num_stages);
+	return num_stages > 0 ? statuses[num_stages - 1] : 0;
+}
+
+static int run_stream(lua_State *L, FILE *stream) {
+	// one command line per line, # starts a comment or the shebang
+	lush_arena_t arena;
+	lush_arena_init(&arena);
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	while ((len = getline(&line, &cap, stream)) != -1) {
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = '\0';
+		char *start = line;
+		while (*start == ' ' || *start == '\t')
+			start++;
+		if (*start == '\0' || *start == '#')
+			continue;
+		if (!run_line(L, &arena, start))
+			break;
+	}
+	free(line);
+	lush_arena_free(&arena);
+	return last_status();
+}
+
+static int run_batch(lua_State *L, int argc, char *argv[]) {
+	if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+		if (argc < 3) {
+			fprintf(stderr, "lush: -c: option requires an argument\n");
+			return 2;
+		}
+		FILE *stream = fmemopen(argv[2], strlen(argv[2]), "r");
+		if (stream == NULL) {
+			perror("fmemopen");
+			return 1;
 		}
+		int status = run_stream(L, stream);
+		fclose(stream);
+		return status;
 	}
 
-	return lush_execute_pipeline(commands, num_commands);
+	if (argc > 1) {
+		// lush script.lua args or a #!/usr/bin/lush file of command lines
+		const char *ext = strrchr(argv[1], '.');
+		if (ext && strcmp(ext, ".lua") == 0)
+			return lua_load_script(L, argv[1], &argv[2]);
+		FILE *stream = fopen(argv[1], "r");
+		if (stream == NULL) {
+			fprintf(stderr, "lush: %s: %s\n", argv[1], strerror(errno));
+			return 127;
+		}
+		int status = run_stream(L, stream);
+		fclose(stream);
+		return status;
+	}
+
+	return run_stream(L, stdin);
 }
 
 int main(int argc, char *argv[]) {
@@ -581,65 +2459,64 @@ int main(int argc, char *argv[]) {
 #endif
 		return 0;
 	}
+	lush_trace_init();
+	lush_spawn_helper_init();
+
+	// -c, a script or commands piped in skip the terminal, the prompt and
+	// history entirely and only load the Lua libraries they touch
+	if (argc > 1 || !isatty(STDIN_FILENO)) {
+		lua_State *L = luaL_newstate();
+		lua_open_batch_libs(L);
+		lua_register_api(L);
+		int status = run_batch(L, argc, argv);
+		lua_close(L);
+		return status;
+	}
+
 	lua_State *L = luaL_newstate();
 	luaL_openlibs(L);
 	lua_register_api(L);
+	lush_history_init();
 	// eat ^C in main
 	struct sigaction sa;
 	sa.sa_handler = SIG_IGN;
 	sa.sa_flags = 0;
 	sigemptyset(&sa.sa_mask);
 	sigaction(SIGINT, &sa, NULL);
+	lush_jobs_init();
 
-	int status = 0;
-	while (true) {
-		// Prompt
-		char *username = getenv("USER");
-		char device_name[256];
-		gethostname(device_name, sizeof(device_name));
-		char *cwd = getcwd(NULL, 0);
-
-		// Replace /home/<user> with ~
-		char *home_prefix = "/home/";
-		size_t home_len = strlen(home_prefix) + strlen(username);
-		char *prompt_cwd;
-		if (strncmp(cwd, home_prefix, strlen(home_prefix)) == 0 &&
-			strncmp(cwd + strlen(home_prefix), username, strlen(username)) ==
-				0) {
-			prompt_cwd = malloc(strlen(cwd) - home_len +
-								2); // 1 for ~ and 1 for null terminator
-			snprintf(prompt_cwd, strlen(cwd) - home_len + 2, "~%s",
-					 cwd + home_len);
-		} else {
-			prompt_cwd = strdup(cwd);
-		}
+	// keep the cached terminal width current
+	update_terminal_width();
+	sa.sa_handler = handle_sigwinch;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGWINCH, &sa, NULL);
+
+	// everything parsed from a line lives here until the line is done
+	lush_arena_t arena;
+	lush_arena_init(&arena);
 
-		// Print the prompt
-		printf("[%s@%s:%s] ", username, device_name, prompt_cwd);
+	while (true) {
+		// report background jobs before the prompt like other shells do
+		lush_jobs_notify();
+		lua_reap_orphans();
 		char *line = lush_read_line();
 		lush_push_history(line);
 		printf("\n");
-		if (line == NULL || strlen(line) == 0) {
+		if (line == NULL) {
+			// stdin was closed
+			break;
+		}
+		if (strlen(line) == 0) {
 			free(line);
 			continue;
 		}
-		char **commands = lush_split_pipes(line);
-		char ***args = lush_split_args(commands, &status);
-		if (status == -1) {
-			fprintf(stderr, "lush: Expected end of quoted string\n");
-		} else if (lush_run(L, args, status) == 0) {
+		if (!run_line(L, &arena, line))
 			exit(1);
-		}
-
-		for (int i = 0; args[i]; i++) {
-			free(args[i]);
-		}
-		// add last line to history
-		free(cwd);
-		free(args);
-		free(commands);
 		free(line);
 	}
+	lush_arena_free(&arena);
 	lua_close(L);
 	return 0;
 }
+
+#endif // LUSH_BENCH
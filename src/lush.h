@@ -18,23 +18,108 @@ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
 #ifndef LUSH_H
 #define LUSH_H
 
+#include "arena.h"
 #include <lua.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+// file redirection of one command such as >file or 2>&1
+typedef struct {
+	// the fd of the command that gets replaced, -1 ends the list
+	int fd;
+	// open flags for the target
+	int flags;
+	// set for 2>&1, the fd whose target is copied instead of opening
+	int dup;
+	// NULL if the operator was not followed by a file
+	char *target;
+	bool is_var;
+} lush_redirect_t;
+
+// a parsed command line that can be run any number of times
+typedef struct {
+	// NULL terminated args of every command in the pipeline
+	char ***args;
+	// vars[i][j] is set when args[i][j] has $ variables to expand per run
+	bool **vars;
+	// globs[i][j] is set when args[i][j] is a pattern to expand per run
+	bool **globs;
+	// redirections of every command, applied in the order they were given
+	lush_redirect_t **redirects;
+	int *num_args;
+	int num_commands;
+	// the line ended in &
+	bool background;
+} lush_cmdline_t;
+
+// processes of a pipeline started with lush_start_pipeline
+typedef struct {
+	pid_t *pids;
+	// exit status of each command once lush_wait_pipeline returns
+	int *statuses;
+	int num_commands;
+	// process group of the job, 0 if it shares the one of the shell
+	pid_t pgid;
+} lush_job_t;
+
+typedef int (*lush_builtin_fn)(lua_State *L, char ***args);
 
 int lush_cd(lua_State *L, char ***args);
 int lush_help(lua_State *L, char ***args);
 int lush_exit(lua_State *L, char ***args);
 int lush_time(lua_State *L, char ***args);
+int lush_hash(lua_State *L, char ***args);
+int lush_rehash(lua_State *L, char ***args);
+int lush_jobs(lua_State *L, char ***args);
+int lush_fg(lua_State *L, char ***args);
+int lush_bg(lua_State *L, char ***args);
+int lush_wait(lua_State *L, char ***args);
+int lush_stats(lua_State *L, char ***args);
+int lush_export(lua_State *L, char ***args);
+int lush_unset(lua_State *L, char ***args);
 int lush_lua(lua_State *L, char ***args);
 
 int lush_num_builtins();
+lush_builtin_fn lush_find_builtin(const char *name);
+// add a builtin or remove it if func is NULL, false for the fixed builtins
+bool lush_register_builtin(const char *name, lush_builtin_fn func);
+
+int lush_run(lua_State *L, char ***commands, lush_redirect_t **redirects,
+			 int num_commands, bool background);
 
-int lush_run(lua_State *L, char ***commands, int num_commands);
+void lush_prompt_invalidate();
+// home directory of the user, cached after the first lookup
+const char *lush_home_dir();
+// path with a leading ~ replaced by the home directory, written to buf
+// which holds PATH_MAX bytes, or path itself if there was nothing to do
+const char *lush_expand_home(const char *path, char *buf);
 
 char *lush_read_line();
-char **lush_split_pipes(char *line);
-char ***lush_split_args(char **commands, int *status);
+// strips a trailing & and returns whether there was one
+bool lush_split_background(char *line);
+char **lush_split_pipes(lush_arena_t *arena, char *line);
+char ***lush_split_args(lush_arena_t *arena, char **commands,
+						lush_redirect_t ***redirects, int *status);
+int lush_compile_line(lush_arena_t *arena, const char *line,
+					  lush_cmdline_t *cmdline);
+char ***lush_expand_line(lush_arena_t *arena, const lush_cmdline_t *cmdline);
 
-void lush_execute_command(char **args, int input_fd, int output_fd);
-int lush_execute_pipeline(char ***commands, int num_commands);
+// pgid is -1 to stay in the shell's group, 0 to lead a new one
+pid_t lush_execute_command(char **args, int input_fd, int output_fd,
+						   int error_fd, pid_t pgid);
+// fork a pipeline stage with its fds and signals set up, 0 in the child
+pid_t lush_fork_stage(int input_fd, int output_fd, int error_fd, pid_t pgid);
+int lush_execute_pipeline(char ***commands, lush_redirect_t **redirects,
+						  int num_commands, bool background);
+int lush_start_pipeline(lush_job_t *job, char ***commands,
+						lush_redirect_t **redirects, int num_commands,
+						int input_fd, int output_fd, int error_fd,
+						bool own_group);
+void lush_wait_pipeline(lush_job_t *job);
+void lush_free_job(lush_job_t *job);
+// reap pid if it has exited, 1 when done, 0 while running, -1 on error
+int lush_try_wait(pid_t pid, int *status);
+const int *lush_get_pipestatus(int *num_stages);
+void lush_set_pipestatus(const int *statuses, int num_stages);
 
 #endif // LUSH_H
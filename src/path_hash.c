@@ -0,0 +1,327 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "path_hash.h"
+#include "hashmap.h"
+#include "vars.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// misses are remembered for this long so new installs show up quickly
+#define NEGATIVE_TTL_SECONDS 2
+
+typedef struct {
+	// NULL if the name was not found in PATH
+	char *path;
+	time_t looked_up_at;
+	unsigned int hits;
+} path_entry_t;
+
+static lush_hashmap_t path_cache;
+static bool path_cache_ready = false;
+
+// every executable name in PATH for completion, sorted so a prefix is a
+// contiguous range found with two binary searches
+typedef struct {
+	char **names;
+	size_t count;
+	// PATH the index was built from and the mtime of each of its entries
+	char *path_env;
+	struct timespec *mtimes;
+	size_t num_dirs;
+	bool ready;
+} command_index_t;
+
+static command_index_t command_index = {NULL, 0, NULL, NULL, 0, false};
+
+static void free_entry(void *value) {
+	path_entry_t *entry = value;
+	free(entry->path);
+	free(entry);
+}
+
+static void ensure_cache() {
+	if (!path_cache_ready) {
+		lush_hashmap_init(&path_cache, free_entry);
+		path_cache_ready = true;
+	}
+}
+
+static time_t now_seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static char *search_path(const char *name) {
+	const char *path_env = lush_var_get("PATH");
+	if (path_env == NULL)
+		path_env = "/usr/local/bin:/usr/bin:/bin";
+
+	char candidate[PATH_MAX];
+	const char *dir = path_env;
+	while (true) {
+		const char *end = strchr(dir, ':');
+		size_t dir_len = end ? (size_t)(end - dir) : strlen(dir);
+		// an empty entry means the current directory
+		int len = dir_len == 0
+					  ? snprintf(candidate, sizeof(candidate), "./%s", name)
+					  : snprintf(candidate, sizeof(candidate), "%.*s/%s",
+								 (int)dir_len, dir, name);
+
+		struct stat st;
+		if (len > 0 && (size_t)len < sizeof(candidate) &&
+			stat(candidate, &st) == 0 && S_ISREG(st.st_mode) &&
+			access(candidate, X_OK) == 0) {
+			return strdup(candidate);
+		}
+
+		if (end == NULL)
+			break;
+		dir = end + 1;
+	}
+	return NULL;
+}
+
+static path_entry_t *resolve(const char *name) {
+	path_entry_t *entry = malloc(sizeof(path_entry_t));
+	if (entry == NULL) {
+		perror("malloc");
+		return NULL;
+	}
+	entry->path = search_path(name);
+	entry->looked_up_at = now_seconds();
+	entry->hits = 0;
+
+	if (!lush_hashmap_put(&path_cache, name, entry)) {
+		free_entry(entry);
+		return NULL;
+	}
+	return entry;
+}
+
+const char *lush_path_lookup(const char *name) {
+	// names with a slash are never searched for
+	if (strchr(name, '/'))
+		return name;
+
+	ensure_cache();
+	path_entry_t *entry = lush_hashmap_get(&path_cache, name);
+	if (entry == NULL ||
+		(entry->path == NULL &&
+		 now_seconds() - entry->looked_up_at >= NEGATIVE_TTL_SECONDS)) {
+		entry = resolve(name);
+		if (entry == NULL)
+			return NULL;
+	}
+
+	entry->hits++;
+	return entry->path;
+}
+
+bool lush_path_hash(const char *name) {
+	if (strchr(name, '/'))
+		return true;
+
+	ensure_cache();
+	path_entry_t *entry = resolve(name);
+	return entry != NULL && entry->path != NULL;
+}
+
+static void free_index() {
+	for (size_t i = 0; i < command_index.count; i++)
+		free(command_index.names[i]);
+	free(command_index.names);
+	free(command_index.path_env);
+	free(command_index.mtimes);
+	command_index = (command_index_t){NULL, 0, NULL, NULL, 0, false};
+}
+
+void lush_path_rehash() {
+	if (path_cache_ready)
+		lush_hashmap_clear(&path_cache);
+	free_index();
+}
+
+void lush_path_print() {
+	if (!path_cache_ready || path_cache.count == 0) {
+		printf("hash: hash table empty\n");
+		return;
+	}
+
+	printf("hits\tcommand\n");
+	size_t iter = 0;
+	const char *name;
+	void *value;
+	while (lush_hashmap_next(&path_cache, &iter, &name, &value)) {
+		path_entry_t *entry = value;
+		if (entry->path)
+			printf("%4u\t%s\n", entry->hits, entry->path);
+	}
+}
+
+// -- command index --
+
+static const char *current_path() {
+	const char *path_env = lush_var_get("PATH");
+	return path_env ? path_env : "/usr/local/bin:/usr/bin:/bin";
+}
+
+static void dir_mtime(const char *dir, struct timespec *mtime) {
+	struct stat st;
+	if (stat(*dir ? dir : ".", &st) == 0)
+		*mtime = st.st_mtim;
+	else
+		*mtime = (struct timespec){0, 0};
+}
+
+static bool index_stale() {
+	const char *path_env = current_path();
+	if (!command_index.ready || strcmp(command_index.path_env, path_env) != 0)
+		return true;
+
+	// one stat per PATH entry is all a completion costs once indexed
+	char dir[PATH_MAX];
+	size_t i = 0;
+	for (const char *start = path_env;; i++) {
+		const char *end = strchr(start, ':');
+		size_t len = end ? (size_t)(end - start) : strlen(start);
+		snprintf(dir, sizeof(dir), "%.*s", (int)len, start);
+		struct timespec mtime;
+		dir_mtime(dir, &mtime);
+		if (mtime.tv_sec != command_index.mtimes[i].tv_sec ||
+			mtime.tv_nsec != command_index.mtimes[i].tv_nsec)
+			return true;
+		if (end == NULL)
+			break;
+		start = end + 1;
+	}
+	return false;
+}
+
+static void index_dir(const char *dir, lush_hashmap_t *seen, size_t *cap) {
+	DIR *handle = opendir(*dir ? dir : ".");
+	if (handle == NULL)
+		return;
+	int fd = dirfd(handle);
+	struct dirent *entry;
+	while ((entry = readdir(handle)) != NULL) {
+		const char *name = entry->d_name;
+		// earlier PATH entries shadow later ones just like lookups do
+		if (name[0] == '.' || lush_hashmap_get(seen, name))
+			continue;
+		if (entry->d_type != DT_REG && entry->d_type != DT_LNK &&
+			entry->d_type != DT_UNKNOWN)
+			continue;
+		struct stat st;
+		if (entry->d_type != DT_REG &&
+			(fstatat(fd, name, &st, 0) != 0 || !S_ISREG(st.st_mode)))
+			continue;
+		if (faccessat(fd, name, X_OK, 0) != 0)
+			continue;
+
+		if (command_index.count == *cap) {
+			*cap = *cap ? *cap * 2 : 1024;
+			char **names = realloc(command_index.names, *cap * sizeof(char *));
+			if (names == NULL) {
+				perror("realloc failed");
+				exit(1);
+			}
+			command_index.names = names;
+		}
+		command_index.names[command_index.count++] = strdup(name);
+		lush_hashmap_put(seen, name, (void *)1);
+	}
+	closedir(handle);
+}
+
+static int compare_names(const void *a, const void *b) {
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void build_index() {
+	free_index();
+	const char *path_env = current_path();
+	command_index.path_env = strdup(path_env);
+	command_index.num_dirs = 1;
+	for (const char *c = path_env; *c; c++) {
+		if (*c == ':')
+			command_index.num_dirs++;
+	}
+	command_index.mtimes =
+		calloc(command_index.num_dirs, sizeof(struct timespec));
+	if (command_index.path_env == NULL || command_index.mtimes == NULL) {
+		perror("calloc failed");
+		exit(1);
+	}
+
+	lush_hashmap_t seen;
+	lush_hashmap_init(&seen, NULL);
+	size_t cap = 0;
+	char dir[PATH_MAX];
+	size_t i = 0;
+	for (const char *start = path_env;; i++) {
+		const char *end = strchr(start, ':');
+		size_t len = end ? (size_t)(end - start) : strlen(start);
+		snprintf(dir, sizeof(dir), "%.*s", (int)len, start);
+		// taken before reading so a change during the scan is seen later
+		dir_mtime(dir, &command_index.mtimes[i]);
+		index_dir(dir, &seen, &cap);
+		if (end == NULL)
+			break;
+		start = end + 1;
+	}
+	lush_hashmap_free(&seen);
+
+	qsort(command_index.names, command_index.count, sizeof(char *),
+		  compare_names);
+	command_index.ready = true;
+}
+
+static size_t lower_bound(const char *prefix, size_t len, bool past) {
+	// first name not below prefix, or past every name it starts
+	size_t low = 0;
+	size_t high = command_index.count;
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+		int cmp = strncmp(command_index.names[mid], prefix, len);
+		if (cmp < 0 || (past && cmp == 0))
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+const char *const *lush_path_complete(const char *prefix, size_t *count) {
+	if (index_stale())
+		build_index();
+
+	size_t len = strlen(prefix);
+	size_t first = lower_bound(prefix, len, false);
+	*count = lower_bound(prefix, len, true) - first;
+	if (*count == 0)
+		return NULL;
+	return (const char *const *)command_index.names + first;
+}
@@ -0,0 +1,35 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef PATH_HASH_H
+#define PATH_HASH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// resolve a command name to the absolute path execv needs, cached per name
+const char *lush_path_lookup(const char *name);
+// forget every cached location, needed once PATH changes
+void lush_path_rehash();
+// resolve and remember a name even if it was cached before
+bool lush_path_hash(const char *name);
+void lush_path_print();
+// sorted executables in PATH starting with prefix, the index is built on
+// first use and rebuilt once PATH or one of its directories changes
+const char *const *lush_path_complete(const char *prefix, size_t *count);
+
+#endif // PATH_HASH_H
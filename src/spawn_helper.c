@@ -0,0 +1,342 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#define _GNU_SOURCE
+
+#include "spawn_helper.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// a request is this header with stdin, stdout, stderr and the shell's
+// working directory attached, then size bytes of NUL terminated strings:
+// the path, the args and the env
+typedef struct {
+	pid_t pgid;
+	// the helper was forked once, so cwd and umask come with every command
+	mode_t umask;
+	uint32_t num_args;
+	uint32_t num_env;
+	uint32_t size;
+} request_t;
+
+typedef struct {
+	// -1 if the helper could not fork at all
+	pid_t pid;
+	// errno of a failed exec, the process has exited and needs reaping
+	int error;
+} reply_t;
+
+// signals the shell and the helper ignore but commands should not
+static const int default_signals[] = {SIGINT,  SIGQUIT, SIGTSTP,
+									  SIGTTIN, SIGTTOU, SIGPIPE};
+#define NUM_DEFAULT_SIGNALS                                                    \
+	(sizeof(default_signals) / sizeof(default_signals[0]))
+// stdin, stdout, stderr and the working directory
+#define NUM_REQUEST_FDS 4
+
+static int helper_fd = -1;
+static pid_t helper_pid = -1;
+// forks of the shell must not share the socket with it
+static pid_t owner_pid = -1;
+static char *request_buf = NULL;
+static size_t request_cap = 0;
+
+static bool write_full(int fd, const void *data, size_t len) {
+	const char *pos = data;
+	while (len > 0) {
+		ssize_t n = send(fd, pos, len, MSG_NOSIGNAL);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		pos += n;
+		len -= n;
+	}
+	return true;
+}
+
+static bool read_full(int fd, void *data, size_t len) {
+	char *pos = data;
+	while (len > 0) {
+		ssize_t n = read(fd, pos, len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		pos += n;
+		len -= n;
+	}
+	return true;
+}
+
+// -- helper process --
+
+static bool receive_request(int fd, request_t *request,
+							int fds[NUM_REQUEST_FDS]) {
+	char control[CMSG_SPACE(NUM_REQUEST_FDS * sizeof(int))];
+	struct iovec iov = {request, sizeof(request_t)};
+	struct msghdr msg = {0};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	ssize_t n;
+	while ((n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR)
+		;
+	if (n <= 0)
+		return false;
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+		cmsg->cmsg_len != CMSG_LEN(NUM_REQUEST_FDS * sizeof(int)))
+		return false;
+	memcpy(fds, CMSG_DATA(cmsg), NUM_REQUEST_FDS * sizeof(int));
+	// the fds come with the first byte, the rest of the header may lag
+	return read_full(fd, (char *)request + n, sizeof(request_t) - n);
+}
+
+static pid_t start_child(const char *path, char **args, char **envp,
+						 const int fds[NUM_REQUEST_FDS],
+						 const request_t *request, int *error) {
+	// CLONE_PARENT makes the shell the parent, so it waits for the command
+	// like for any other child. a close on exec pipe tells if exec worked
+	int status_pipe[2];
+	if (pipe2(status_pipe, O_CLOEXEC) == -1) {
+		*error = errno;
+		return -1;
+	}
+	pid_t pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, 0, 0, 0);
+	if (pid == 0) {
+		if (request->pgid >= 0)
+			setpgid(0, request->pgid);
+		umask(request->umask);
+		// same order as posix_spawn in the shell, stderr goes first
+		dup2(fds[2], STDERR_FILENO);
+		dup2(fds[0], STDIN_FILENO);
+		dup2(fds[1], STDOUT_FILENO);
+		for (size_t i = 0; i < NUM_DEFAULT_SIGNALS; i++)
+			signal(default_signals[i], SIG_DFL);
+		sigset_t mask;
+		sigemptyset(&mask);
+		sigprocmask(SIG_SETMASK, &mask, NULL);
+		// relative paths and commands are meant for the shell's directory
+		if (fchdir(fds[3]) == 0)
+			execve(path, args, envp);
+		int exec_error = errno;
+		write(status_pipe[1], &exec_error, sizeof(exec_error));
+		_exit(127);
+	}
+	*error = pid == -1 ? errno : 0;
+	close(status_pipe[1]);
+	if (pid > 0) {
+		int exec_error;
+		if (read_full(status_pipe[0], &exec_error, sizeof(exec_error)))
+			*error = exec_error;
+	}
+	close(status_pipe[0]);
+	return pid;
+}
+
+static void serve(int fd) {
+	for (;;) {
+		request_t request;
+		int fds[NUM_REQUEST_FDS];
+		if (!receive_request(fd, &request, fds))
+			_exit(0);
+
+		reply_t reply = {-1, EINVAL};
+		char *strings = malloc(request.size + 1);
+		char **args = malloc((request.num_args + 1) * sizeof(char *));
+		char **envp = malloc((request.num_env + 1) * sizeof(char *));
+		if (!strings || !args || !envp ||
+			!read_full(fd, strings, request.size))
+			_exit(1);
+		strings[request.size] = '\0';
+
+		// cut the strings apart, a request short of strings is refused
+		char *pos = strings;
+		char *end = strings + request.size;
+		const char *path = pos;
+		pos += strlen(pos) + 1;
+		uint32_t num_args = 0;
+		uint32_t num_env = 0;
+		while (num_args < request.num_args && pos < end) {
+			args[num_args++] = pos;
+			pos += strlen(pos) + 1;
+		}
+		while (num_env < request.num_env && pos < end) {
+			envp[num_env++] = pos;
+			pos += strlen(pos) + 1;
+		}
+		args[num_args] = NULL;
+		envp[num_env] = NULL;
+		bool complete =
+			num_args == request.num_args && num_env == request.num_env;
+
+		if (complete && request.num_args > 0)
+			reply.pid = start_child(path, args, envp, fds, &request,
+									&reply.error);
+		for (int k = 0; k < NUM_REQUEST_FDS; k++)
+			close(fds[k]);
+		free(strings);
+		free(args);
+		free(envp);
+		if (!write_full(fd, &reply, sizeof(reply)))
+			_exit(0);
+	}
+}
+
+void lush_spawn_helper_init() {
+	const char *env = getenv("LUSH_SPAWN_HELPER");
+	if (env == NULL || *env == '\0' || strcmp(env, "0") == 0)
+		return;
+
+	int sockets[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) == -1) {
+		perror("lush: spawn helper");
+		return;
+	}
+	pid_t pid = fork();
+	if (pid == 0) {
+		// terminal signals are for the shell and its jobs, the helper only
+		// exits once the shell closes its end of the socket
+		close(sockets[0]);
+		for (size_t i = 0; i < NUM_DEFAULT_SIGNALS; i++)
+			signal(default_signals[i], SIG_IGN);
+		serve(sockets[1]);
+	}
+	close(sockets[1]);
+	if (pid == -1) {
+		perror("lush: spawn helper");
+		close(sockets[0]);
+		return;
+	}
+	helper_fd = sockets[0];
+	helper_pid = pid;
+	owner_pid = getpid();
+}
+
+// -- shell side --
+
+static void stop_helper() {
+	close(helper_fd);
+	helper_fd = -1;
+	kill(helper_pid, SIGKILL);
+	waitpid(helper_pid, NULL, 0);
+	helper_pid = -1;
+}
+
+bool lush_spawn_helper_running() {
+	return helper_fd != -1 && getpid() == owner_pid;
+}
+
+static bool append_string(size_t *len, const char *str) {
+	size_t str_len = strlen(str) + 1;
+	if (*len + str_len > request_cap) {
+		size_t cap = request_cap ? request_cap : 4096;
+		while (cap < *len + str_len)
+			cap *= 2;
+		char *buf = realloc(request_buf, cap);
+		if (buf == NULL) {
+			perror("realloc");
+			return false;
+		}
+		request_buf = buf;
+		request_cap = cap;
+	}
+	memcpy(request_buf + *len, str, str_len);
+	*len += str_len;
+	return true;
+}
+
+pid_t lush_spawn_helper_spawn(const char *path, char **args, char **envp,
+							  int input_fd, int output_fd, int error_fd,
+							  pid_t pgid, int *error) {
+	// O_PATH needs no read permission on the directory
+	*error = 0;
+	int cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (cwd_fd == -1)
+		return -1;
+	mode_t mask = umask(0);
+	umask(mask);
+	request_t request = {pgid, mask, 0, 0, 0};
+	size_t len = 0;
+	bool ok = append_string(&len, path);
+	for (; ok && args[request.num_args]; request.num_args++)
+		ok = append_string(&len, args[request.num_args]);
+	for (; ok && envp && envp[request.num_env]; request.num_env++)
+		ok = append_string(&len, envp[request.num_env]);
+	if (!ok) {
+		close(cwd_fd);
+		return -1;
+	}
+	request.size = len;
+
+	int fds[NUM_REQUEST_FDS] = {input_fd, output_fd, error_fd, cwd_fd};
+	char control[CMSG_SPACE(sizeof(fds))];
+	memset(control, 0, sizeof(control));
+	struct iovec iov = {&request, sizeof(request)};
+	struct msghdr msg = {0};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	ssize_t sent;
+	while ((sent = sendmsg(helper_fd, &msg, MSG_NOSIGNAL)) == -1 &&
+		   errno == EINTR)
+		;
+	close(cwd_fd);
+	reply_t reply;
+	if (sent <= 0 ||
+		!write_full(helper_fd, (char *)&request + sent,
+					sizeof(request) - sent) ||
+		!write_full(helper_fd, request_buf, len) ||
+		!read_full(helper_fd, &reply, sizeof(reply))) {
+		// commands are started by the shell itself from now on
+		stop_helper();
+		return -1;
+	}
+	if (reply.pid == -1) {
+		// the helper could not fork this time, it stays up for the next
+		*error = reply.error;
+		return -1;
+	}
+	if (reply.error != 0) {
+		// the child only ran to report the exec error
+		waitpid(reply.pid, NULL, 0);
+		*error = reply.error;
+		return -1;
+	}
+	return reply.pid;
+}
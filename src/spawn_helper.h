@@ -0,0 +1,37 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef SPAWN_HELPER_H
+#define SPAWN_HELPER_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+// fork the spawn helper if LUSH_SPAWN_HELPER is set, this has to happen
+// before the Lua state is created so the helper stays small
+void lush_spawn_helper_init();
+// false if the helper is off, went away or this is a fork of the shell
+bool lush_spawn_helper_running();
+// start path through the helper as a child of the shell in the current
+// directory. -1 with error set if exec or the helper's fork failed, or 0 if
+// the command should be started some other way. the helper is only stopped
+// if it stops answering
+pid_t lush_spawn_helper_spawn(const char *path, char **args, char **envp,
+							  int input_fd, int output_fd, int error_fd,
+							  pid_t pgid, int *error);
+
+#endif // SPAWN_HELPER_H
@@ -0,0 +1,137 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "stats.h"
+#include <stdbool.h>
+#include <time.h>
+
+// children that are running at once, more than this go untimed
+#define MAX_TIMED_CHILDREN 1024
+// child times land in buckets four to every power of two nanoseconds
+#define BUCKETS_PER_POWER 4
+#define NUM_BUCKETS (64 * BUCKETS_PER_POWER)
+
+static const char *stat_names[LUSH_NUM_STATS] = {
+	"commands",		 "forks",		 "exec_failures",	  "children_reaped",
+	"history_bytes", "script_loads", "script_cache_hits", "redraw_bytes"};
+
+static uint64_t counters[LUSH_NUM_STATS];
+
+typedef struct {
+	// 0 marks a free slot
+	pid_t pid;
+	uint64_t started;
+} timed_child_t;
+
+// open addressing table of running children keyed by pid
+static timed_child_t children[MAX_TIMED_CHILDREN];
+static uint64_t histogram[NUM_BUCKETS];
+static uint64_t child_total_ns = 0;
+static uint64_t child_count = 0;
+
+void lush_stat_add(lush_stat_t stat, uint64_t amount) {
+	counters[stat] += amount;
+}
+
+uint64_t lush_stat_get(lush_stat_t stat) { return counters[stat]; }
+
+const char *lush_stat_name(lush_stat_t stat) { return stat_names[stat]; }
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t find_slot(pid_t pid) {
+	// the slot holding pid or the free slot where it would go
+	size_t slot = (size_t)pid % MAX_TIMED_CHILDREN;
+	for (size_t i = 0; i < MAX_TIMED_CHILDREN; i++) {
+		if (children[slot].pid == pid || children[slot].pid == 0)
+			return slot;
+		slot = (slot + 1) % MAX_TIMED_CHILDREN;
+	}
+	return MAX_TIMED_CHILDREN;
+}
+
+void lush_stat_child_started(pid_t pid) {
+	size_t slot = find_slot(pid);
+	if (slot == MAX_TIMED_CHILDREN)
+		return;
+	children[slot].pid = pid;
+	children[slot].started = now_ns();
+}
+
+static size_t bucket_of(uint64_t ns) {
+	// the top bits pick the power of two, the next two bits split it
+	if (ns < BUCKETS_PER_POWER)
+		return ns;
+	int power = 63 - __builtin_clzll(ns);
+	size_t sub = (ns >> (power - 2)) & (BUCKETS_PER_POWER - 1);
+	return power * BUCKETS_PER_POWER + sub;
+}
+
+static uint64_t bucket_limit(size_t bucket) {
+	// largest time that still falls into bucket
+	if (bucket < BUCKETS_PER_POWER)
+		return bucket;
+	int power = bucket / BUCKETS_PER_POWER;
+	uint64_t sub = bucket % BUCKETS_PER_POWER;
+	return ((BUCKETS_PER_POWER + sub + 1) << (power - 2)) - 1;
+}
+
+void lush_stat_child_reaped(pid_t pid) {
+	counters[LUSH_STAT_CHILDREN_REAPED]++;
+	size_t slot = find_slot(pid);
+	if (slot == MAX_TIMED_CHILDREN || children[slot].pid != pid)
+		return;
+	uint64_t elapsed = now_ns() - children[slot].started;
+	child_total_ns += elapsed;
+	child_count++;
+	histogram[bucket_of(elapsed)]++;
+
+	// pull later entries of the probe chain back so lookups never stop early
+	size_t hole = slot;
+	size_t next = (hole + 1) % MAX_TIMED_CHILDREN;
+	while (next != slot && children[next].pid != 0) {
+		size_t home = (size_t)children[next].pid % MAX_TIMED_CHILDREN;
+		// moves unless home lies cyclically within (hole, next]
+		bool stays = hole <= next ? (hole < home && home <= next)
+								  : (hole < home || home <= next);
+		if (!stays) {
+			children[hole] = children[next];
+			hole = next;
+		}
+		next = (next + 1) % MAX_TIMED_CHILDREN;
+	}
+	children[hole].pid = 0;
+}
+
+uint64_t lush_stat_child_total_ns() { return child_total_ns; }
+
+uint64_t lush_stat_child_p99_ns() {
+	if (child_count == 0)
+		return 0;
+	uint64_t rank = child_count - child_count / 100;
+	uint64_t seen = 0;
+	for (size_t i = 0; i < NUM_BUCKETS; i++) {
+		seen += histogram[i];
+		if (seen >= rank)
+			return bucket_limit(i);
+	}
+	return bucket_limit(NUM_BUCKETS - 1);
+}
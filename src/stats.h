@@ -0,0 +1,48 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef enum {
+	LUSH_STAT_COMMANDS,
+	LUSH_STAT_FORKS,
+	LUSH_STAT_EXEC_FAILURES,
+	LUSH_STAT_CHILDREN_REAPED,
+	LUSH_STAT_HISTORY_BYTES,
+	LUSH_STAT_SCRIPT_LOADS,
+	LUSH_STAT_SCRIPT_CACHE_HITS,
+	LUSH_STAT_REDRAW_BYTES,
+	LUSH_NUM_STATS
+} lush_stat_t;
+
+void lush_stat_add(lush_stat_t stat, uint64_t amount);
+uint64_t lush_stat_get(lush_stat_t stat);
+// name of a counter as lush.stats and the stats builtin show it
+const char *lush_stat_name(lush_stat_t stat);
+
+// wall time of children from being started until they are reaped
+void lush_stat_child_started(pid_t pid);
+void lush_stat_child_reaped(pid_t pid);
+uint64_t lush_stat_child_total_ns();
+// upper bound of the bucket holding the 99th percentile, 0 without data
+uint64_t lush_stat_child_p99_ns();
+
+#endif // STATS_H
@@ -0,0 +1,170 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// the newest events are kept, older ones are overwritten
+#define TRACE_CAPACITY 65536
+#define TRACE_DETAIL_LEN 64
+
+typedef struct {
+	// only ever string literals so nothing has to be copied
+	const char *name;
+	// X for a span, b and e for the two ends of a process
+	char phase;
+	pid_t pid;
+	uint64_t start;
+	uint64_t duration;
+	char detail[TRACE_DETAIL_LEN];
+} trace_event_t;
+
+static trace_event_t *events = NULL;
+// count of events ever recorded, the slot is this modulo the ring size so
+// the oldest events are overwritten once it is full
+static uint64_t next_event = 0;
+static bool tracing = false;
+static uint64_t trace_epoch = 0;
+// the file given through LUSH_TRACE and the process that has to write it
+static char *exit_path = NULL;
+static pid_t exit_pid = 0;
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void write_at_exit() {
+	// forked children run atexit handlers as well
+	if (getpid() == exit_pid)
+		lush_trace_export(exit_path);
+}
+
+void lush_trace_init() {
+	const char *path = getenv("LUSH_TRACE");
+	if (path == NULL || *path == '\0')
+		return;
+	exit_path = strdup(path);
+	exit_pid = getpid();
+	atexit(write_at_exit);
+	lush_trace_enable(true);
+}
+
+void lush_trace_enable(bool on) {
+	if (on && events == NULL) {
+		events = calloc(TRACE_CAPACITY, sizeof(trace_event_t));
+		if (events == NULL) {
+			perror("calloc failed");
+			return;
+		}
+		trace_epoch = now_ns();
+	}
+	tracing = on;
+}
+
+bool lush_trace_enabled() { return tracing; }
+
+uint64_t lush_trace_begin() { return tracing ? now_ns() : 0; }
+
+static void record(const char *name, char phase, pid_t pid, uint64_t start,
+				   uint64_t end, const char *detail) {
+	uint64_t slot = __atomic_fetch_add(&next_event, 1, __ATOMIC_RELAXED);
+	trace_event_t *event = &events[slot % TRACE_CAPACITY];
+	event->name = name;
+	event->phase = phase;
+	event->pid = pid;
+	event->start = start;
+	event->duration = end - start;
+	if (detail)
+		snprintf(event->detail, sizeof(event->detail), "%s", detail);
+	else
+		event->detail[0] = '\0';
+}
+
+void lush_trace_span(const char *name, uint64_t start, const char *detail) {
+	// a span that began before tracing was turned on is dropped
+	if (!tracing || start == 0)
+		return;
+	record(name, 'X', 0, start, now_ns(), detail);
+}
+
+void lush_trace_process_start(pid_t pid, uint64_t start, const char *command) {
+	if (!tracing || start == 0)
+		return;
+	record("process", 'b', pid, start, start, command);
+}
+
+void lush_trace_process_exit(pid_t pid, int status) {
+	if (!tracing)
+		return;
+	char detail[16];
+	snprintf(detail, sizeof(detail), "%d", status);
+	uint64_t now = now_ns();
+	record("process", 'e', pid, now, now, detail);
+}
+
+static void write_string(FILE *fp, const char *str) {
+	fputc('"', fp);
+	for (const unsigned char *c = (const unsigned char *)str; *c; c++) {
+		if (*c == '"' || *c == '\\')
+			fprintf(fp, "\\%c", *c);
+		else if (*c < 0x20)
+			fprintf(fp, "\\u%04x", *c);
+		else
+			fputc(*c, fp);
+	}
+	fputc('"', fp);
+}
+
+bool lush_trace_export(const char *path) {
+	FILE *fp = fopen(path, "w");
+	if (fp == NULL)
+		return false;
+
+	uint64_t end = __atomic_load_n(&next_event, __ATOMIC_ACQUIRE);
+	uint64_t first = end > TRACE_CAPACITY ? end - TRACE_CAPACITY : 0;
+	pid_t shell = getpid();
+
+	// timestamps are in microseconds, processes get async events keyed by
+	// pid so each child shows up as its own bar
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	for (uint64_t i = first; events && i < end; i++) {
+		const trace_event_t *event = &events[i % TRACE_CAPACITY];
+		double ts = (double)(event->start - trace_epoch) / 1000.0;
+		fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,",
+				i == first ? "" : ",\n", event->name, event->phase, ts);
+		if (event->phase == 'X')
+			fprintf(fp, "\"dur\":%.3f,", event->duration / 1000.0);
+		else
+			fprintf(fp, "\"cat\":\"process\",\"id\":%d,", (int)event->pid);
+		fprintf(fp, "\"pid\":%d,\"tid\":%d", (int)shell, (int)shell);
+		if (event->detail[0]) {
+			fprintf(fp, ",\"args\":{\"%s\":",
+					event->phase == 'e' ? "status" : "detail");
+			write_string(fp, event->detail);
+			fputc('}', fp);
+		}
+		fputc('}', fp);
+	}
+	fprintf(fp, "\n]}\n");
+	return fclose(fp) == 0;
+}
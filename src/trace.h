@@ -0,0 +1,41 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// enables tracing if LUSH_TRACE names a file, it is written when lush exits
+void lush_trace_init();
+void lush_trace_enable(bool on);
+bool lush_trace_enabled();
+
+// start time for lush_trace_span, 0 while tracing is off
+uint64_t lush_trace_begin();
+// records a span from start until now, detail may be NULL
+void lush_trace_span(const char *name, uint64_t start, const char *detail);
+// a child from the start of its spawn until it is reaped
+void lush_trace_process_start(pid_t pid, uint64_t start, const char *command);
+void lush_trace_process_exit(pid_t pid, int status);
+
+// writes every buffered event as Chrome trace JSON
+bool lush_trace_export(const char *path);
+
+#endif // TRACE_H
@@ -0,0 +1,234 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "vars.h"
+#include "hashmap.h"
+#include "lush.h"
+#include "path_hash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern char **environ;
+
+typedef struct {
+	char *value;
+	bool exported;
+} var_t;
+
+static lush_hashmap_t vars;
+static bool vars_loaded = false;
+// envp handed out last, NULL until the first command starts
+static char **envp = NULL;
+static bool envp_dirty = true;
+
+static void free_var(void *value) {
+	var_t *var = value;
+	free(var->value);
+	free(var);
+}
+
+static bool is_name(const char *name, size_t len) {
+	if (len == 0 || (name[0] >= '0' && name[0] <= '9'))
+		return false;
+	for (size_t i = 0; i < len; i++) {
+		char c = name[i];
+		if (!(c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+			  (c >= '0' && c <= '9')))
+			return false;
+	}
+	return true;
+}
+
+static bool store(const char *name, const char *value, bool export) {
+	var_t *var = lush_hashmap_get(&vars, name);
+	char *copy = strdup(value);
+	if (copy == NULL) {
+		perror("strdup");
+		return false;
+	}
+	if (var) {
+		free(var->value);
+		var->value = copy;
+		var->exported = var->exported || export;
+		return true;
+	}
+	var = malloc(sizeof(var_t));
+	if (var == NULL) {
+		perror("malloc");
+		free(copy);
+		return false;
+	}
+	var->value = copy;
+	var->exported = export;
+	if (!lush_hashmap_put(&vars, name, var)) {
+		free_var(var);
+		return false;
+	}
+	return true;
+}
+
+static void load_vars() {
+	if (vars_loaded)
+		return;
+	vars_loaded = true;
+	lush_hashmap_init(&vars, free_var);
+	char name[256];
+	for (char **env = environ; env && *env; env++) {
+		const char *eq = strchr(*env, '=');
+		if (eq == NULL || eq - *env >= (long)sizeof(name))
+			continue;
+		memcpy(name, *env, eq - *env);
+		name[eq - *env] = '\0';
+		store(name, eq + 1, true);
+	}
+}
+
+static void changed(const char *name, const var_t *var, bool was_exported) {
+	// var is NULL once unset. the envp for commands is rebuilt at the next
+	// spawn, environ only gets this one entry updated so getenv and Lua's
+	// os.getenv agree, and libc never frees values handed out by getenv
+	if (var && var->exported) {
+		envp_dirty = true;
+		setenv(name, var->value, 1);
+	} else if (was_exported) {
+		envp_dirty = true;
+		unsetenv(name);
+	}
+	if (strcmp(name, "PATH") == 0)
+		lush_path_rehash();
+	lush_prompt_invalidate();
+}
+
+const char *lush_var_get(const char *name) {
+	load_vars();
+	var_t *var = lush_hashmap_get(&vars, name);
+	return var ? var->value : NULL;
+}
+
+bool lush_var_set(const char *name, const char *value, bool export) {
+	load_vars();
+	if (!is_name(name, strlen(name)))
+		return false;
+	if (!store(name, value, export))
+		return false;
+	changed(name, lush_hashmap_get(&vars, name), false);
+	return true;
+}
+
+bool lush_var_export(const char *name) {
+	load_vars();
+	var_t *var = lush_hashmap_get(&vars, name);
+	if (var == NULL)
+		return false;
+	if (!var->exported) {
+		var->exported = true;
+		changed(name, var, false);
+	}
+	return true;
+}
+
+void lush_var_unset(const char *name) {
+	load_vars();
+	var_t *var = lush_hashmap_get(&vars, name);
+	if (var == NULL)
+		return;
+	bool exported = var->exported;
+	lush_hashmap_remove(&vars, name);
+	changed(name, NULL, exported);
+}
+
+bool lush_var_put(const char *assignment) {
+	const char *eq = strchr(assignment, '=');
+	if (eq == NULL) {
+		lush_var_unset(assignment);
+		return true;
+	}
+	size_t len = eq - assignment;
+	char *name = malloc(len + 1);
+	if (name == NULL) {
+		perror("malloc");
+		return false;
+	}
+	memcpy(name, assignment, len);
+	name[len] = '\0';
+	bool ok = lush_var_set(name, eq + 1, true);
+	free(name);
+	return ok;
+}
+
+bool lush_is_assignment(const char *arg) {
+	const char *eq = strchr(arg, '=');
+	return eq && is_name(arg, eq - arg);
+}
+
+void lush_var_print_exported() {
+	load_vars();
+	size_t iter = 0;
+	const char *name;
+	void *value;
+	while (lush_hashmap_next(&vars, &iter, &name, &value)) {
+		var_t *var = value;
+		if (var->exported)
+			printf("export %s=%s\n", name, var->value);
+	}
+}
+
+char **lush_var_envp() {
+	load_vars();
+	if (!envp_dirty && envp)
+		return envp;
+
+	size_t count = 0;
+	size_t iter = 0;
+	const char *name;
+	void *value;
+	while (lush_hashmap_next(&vars, &iter, &name, &value))
+		count += ((var_t *)value)->exported;
+
+	char **fresh = calloc(count + 1, sizeof(char *));
+	if (fresh == NULL) {
+		perror("calloc");
+		return envp ? envp : environ;
+	}
+	size_t pos = 0;
+	iter = 0;
+	while (lush_hashmap_next(&vars, &iter, &name, &value)) {
+		var_t *var = value;
+		if (!var->exported)
+			continue;
+		size_t len = strlen(name) + strlen(var->value) + 2;
+		fresh[pos] = malloc(len);
+		if (fresh[pos] == NULL) {
+			perror("malloc");
+			break;
+		}
+		snprintf(fresh[pos++], len, "%s=%s", name, var->value);
+	}
+	fresh[pos] = NULL;
+
+	// only commands ever see this array, so the old one can go right away
+	char **old = envp;
+	envp = fresh;
+	envp_dirty = false;
+	if (old) {
+		for (char **env = old; *env; env++)
+			free(*env);
+		free(old);
+	}
+	return envp;
+}
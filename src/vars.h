@@ -0,0 +1,42 @@
+/*
+Copyright (c) 2024, Lance Borden
+All rights reserved.
+
+This software is licensed under the BSD 3-Clause License.
+You may obtain a copy of the license at:
+https://opensource.org/licenses/BSD-3-Clause
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted under the conditions stated in the BSD 3-Clause
+License.
+
+THIS SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTIES,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef VARS_H
+#define VARS_H
+
+#include <stdbool.h>
+
+// shell variables, seeded from the environment on first use. exported
+// variables are passed on to commands, the rest only exist in the shell
+
+// NULL if name is not set
+const char *lush_var_get(const char *name);
+// copies name and value, a variable that was exported stays exported
+bool lush_var_set(const char *name, const char *value, bool export);
+bool lush_var_export(const char *name);
+void lush_var_unset(const char *name);
+// NAME=value or just NAME to unset it, the way putenv takes it
+bool lush_var_put(const char *assignment);
+// true if arg looks like NAME=value
+bool lush_is_assignment(const char *arg);
+// print every exported variable as export NAME=value
+void lush_var_print_exported();
+// environment for new commands, only rebuilt after an exported variable
+// changed. environ is kept in step one entry at a time
+char **lush_var_envp();
+
+#endif // VARS_H